@@ -0,0 +1,5 @@
+#include "atomic_reference.hpp"
+
+const size_t striped_lock::NStripes;
+
+aligned_padded_elem<spinlock> striped_lock::stripes[NStripes];
@@ -1,9 +1,15 @@
 #pragma once
 
 #include <cassert>
+#include <cstdint>
 #include <atomic>
+#include <mutex>
+#include <type_traits>
 
 #include "asm.hpp"
+#include "macros.hpp"
+#include "spinlock.hpp"
+#include "util.hpp"
 
 /**
  * A std::shared_ptr<T>-like abstraction for reference counting,
@@ -46,6 +52,14 @@ public:
     return --count_ == 0;
   }
 
+  // adds n references, and drops one (n may be 0). returns true if that
+  // dropped the last one
+  inline bool
+  transfer(uint32_t n)
+  {
+    return count_.fetch_add(n - 1) + (n - 1) == 0;
+  }
+
 private:
   std::atomic<uint32_t> count_;
 };
@@ -54,15 +68,35 @@ class nop_ref_counted {
 public:
   inline void inc() {}
   inline bool dec() { return false; }
+  inline bool transfer(uint32_t) { return false; }
 };
 
 namespace private_ {
 
+// the low bits which T's alignment leaves free hold the mark (bit 0), and
+// tags (the bits above it). T is only required to be complete once these are
+// used, not when the ptr type is named
 template <typename T>
 struct ptr_ops_mixin {
 
   typedef intptr_t opaque_t;
 
+  static inline opaque_t
+  TagMask()
+  {
+    return (opaque_t(std::alignment_of<T>::value) - 1) | 0x1;
+  }
+
+  template <unsigned int Tag>
+  static inline opaque_t
+  TagBit()
+  {
+    static_assert(Tag > 0, "tag 0 is the mark");
+    static_assert((size_t(1) << Tag) < std::alignment_of<T>::value,
+                  "T is not aligned enough for this tag");
+    return opaque_t(1) << Tag;
+  }
+
   static inline opaque_t
   Mark(opaque_t p)
   {
@@ -78,13 +112,14 @@ struct ptr_ops_mixin {
   static inline T *
   Ptr(opaque_t p)
   {
-    return (T *) (p & ~0x1);
+    return (T *) (p & ~TagMask());
   }
 
+  // ptr w/ op's mark and tags
   static inline opaque_t
   BuildOpaque(T *ptr, opaque_t op)
   {
-    return opaque_t(ptr) | (op & 0x1);
+    return opaque_t(ptr) | (op & TagMask());
   }
 };
 
@@ -97,19 +132,114 @@ public:
   inline bool try_lock() { return true; }
 };
 
+// a LockImpl for atomic_ref_ptr which takes no room in the ptr: ptrs share
+// the spinlocks of a global table, picked by the ptr's address
+class striped_lock {
+public:
+  static const size_t NStripes = 1024;
+
+  static inline spinlock &
+  for_addr(const void *p)
+  {
+    // ptrs are at least 8 byte aligned
+    return stripes[(uintptr_t(p) >> 3) % NStripes].elem;
+  }
+
+private:
+  static aligned_padded_elem<spinlock> stripes[NStripes];
+};
+
+namespace private_ {
+
+// where an atomic_ref_ptr keeps its lock: in the ptr itself by default
+template <typename LockImpl>
+class ref_ptr_lock {
+public:
+  typedef LockImpl lock_type;
+protected:
+  ref_ptr_lock() : mutex_() {}
+  inline lock_type &
+  get_lock() const
+  {
+    return mutex_;
+  }
+private:
+  mutable lock_type mutex_;
+};
+
+// nothing to keep for these
+template <>
+class ref_ptr_lock<nop_lock> {
+public:
+  typedef nop_lock lock_type;
+protected:
+  inline lock_type &
+  get_lock() const
+  {
+    static nop_lock l;
+    return l;
+  }
+};
+
+template <>
+class ref_ptr_lock<striped_lock> {
+public:
+  typedef spinlock lock_type;
+protected:
+  inline lock_type &
+  get_lock() const
+  {
+    return striped_lock::for_addr(this);
+  }
+};
+
+// locks a and b, which may be the same lock (two ptrs can share a stripe)
+template <typename A, typename B>
+class pair_lock_guard {
+public:
+  pair_lock_guard(A &a, B &b) : a_(a), b_(b)
+  {
+    if (same())
+      a_.lock();
+    else
+      std::lock(a_, b_);
+  }
+
+  ~pair_lock_guard()
+  {
+    a_.unlock();
+    if (!same())
+      b_.unlock();
+  }
+
+private:
+  inline bool
+  same() const
+  {
+    return (const void *) &a_ == (const void *) &b_;
+  }
+
+  A &a_;
+  B &b_;
+};
+
+}
+
 // T must inherit atomic_ref_counted (or implement the same interface)
-// this class also supports one-time marking of ptrs.
+// this class also supports one-time marking of ptrs, and tag bits.
 //
 // Doesn't support custom deleter
 template <typename T, typename LockImpl = spinlock>
-class atomic_ref_ptr : public private_::ptr_ops_mixin<T> {
-  typedef typename private_::ptr_ops_mixin<T>::opaque_t opaque_t;
-  typedef LockImpl lock_type;
-  typedef std::lock_guard<lock_type> lock_guard;
+class atomic_ref_ptr : public private_::ptr_ops_mixin<T>,
+                       private private_::ref_ptr_lock<LockImpl> {
+  template <typename U, typename V> friend class atomic_ref_ptr;
+  typedef typename private_::ref_ptr_lock<LockImpl>::lock_type lock_type;
 
 public:
+  typedef typename private_::ptr_ops_mixin<T>::opaque_t opaque_t;
+
   // nullptr constructor
-  atomic_ref_ptr() : ptr_(opaque_t(nullptr)), mutex_() {}
+  atomic_ref_ptr() : ptr_(opaque_t(nullptr)) {}
 
   ~atomic_ref_ptr() {
     T *ptr = get();
@@ -119,7 +249,7 @@ public:
 
   // constructors don't accept a marked ptr
   explicit atomic_ref_ptr(T *ptr)
-    : ptr_(opaque_t(ptr)), mutex_()
+    : ptr_(opaque_t(ptr))
   {
     if (ptr)
       ptr->inc();
@@ -127,7 +257,7 @@ public:
 
   template <typename U>
   explicit atomic_ref_ptr(U *ptr)
-    : ptr_(opaque_t(static_cast<T *>(ptr))), mutex_()
+    : ptr_(opaque_t(static_cast<T *>(ptr)))
   {
     if (ptr)
       ptr->inc();
@@ -140,14 +270,14 @@ public:
   // NOTE: Assigning to a reference preserves its current mark
 
   atomic_ref_ptr(const atomic_ref_ptr &other)
-    : ptr_(opaque_t(nullptr)), mutex_()
+    : ptr_(opaque_t(nullptr))
   {
     assignFrom(other);
   }
 
   template <typename U, typename V>
   atomic_ref_ptr(const atomic_ref_ptr<U, V> &other)
-    : ptr_(opaque_t(nullptr)), mutex_()
+    : ptr_(opaque_t(nullptr))
   {
     assignFrom(other);
   }
@@ -167,6 +297,21 @@ public:
     return *this;
   }
 
+  // Move construction/assignment take over other's reference w/o touching
+  // the count, and leave it null. other must not be in use by anyone else
+  //
+  // NOTE: Moves don't propagate the marks either
+
+  atomic_ref_ptr(atomic_ref_ptr &&other)
+    : ptr_(opaque_t(other.take())) {}
+
+  atomic_ref_ptr &
+  operator=(atomic_ref_ptr &&other)
+  {
+    assign(other.take());
+    return *this;
+  }
+
   explicit inline
   operator bool() const
   {
@@ -211,6 +356,13 @@ public:
     return this->IsMarked(get_raw());
   }
 
+  // the ptr and its mark, read at once
+  inline opaque_t
+  get_raw() const
+  {
+    return ptr_.load();
+  }
+
   // returns when this ptr is marked- returns
   // true if the caller was the one responsible for the marking
   inline bool
@@ -229,16 +381,56 @@ public:
     return true;
   }
 
+  // Tags are the bits above the mark, as many as T's alignment leaves room
+  // for (which is checked at compile time). Like the mark, they change w/o
+  // grabbing the lock, assignments preserve them and copies don't get them.
+  // Unlike the mark, they can be cleared again
+
+  template <unsigned int Tag>
+  inline bool
+  test_tag() const
+  {
+    return get_raw() & this->template TagBit<Tag>();
+  }
+
+  // returns true if the caller was the one to set the tag
+  template <unsigned int Tag>
+  inline bool
+  set_tag()
+  {
+    const opaque_t bit = this->template TagBit<Tag>();
+    return !(ptr_.fetch_or(bit) & bit);
+  }
+
+  // returns true if the caller was the one to clear the tag
+  template <unsigned int Tag>
+  inline bool
+  clear_tag()
+  {
+    const opaque_t bit = this->template TagBit<Tag>();
+    return ptr_.fetch_and(~bit) & bit;
+  }
+
+  // sets the tag to desired, if the ptr, its mark, and all its tags still
+  // read expected_raw
+  template <unsigned int Tag>
+  inline bool
+  compare_exchange_tag(opaque_t expected_raw, bool desired)
+  {
+    const opaque_t bit = this->template TagBit<Tag>();
+    return ptr_.compare_exchange_strong(
+        expected_raw, desired ? expected_raw | bit : expected_raw & ~bit);
+  }
+
   // desired_value is stable by default because it is pass by value, so we
-  // don't need to lock it
+  // don't need to lock it. on success, we take over its reference
   inline bool
   compare_exchange_strong(
       const atomic_ref_ptr &expected_value,
       atomic_ref_ptr desired_value)
   {
-    std::lock(mutex_, expected_value.mutex_);
-    lock_guard l0(mutex_, std::adopt_lock);
-    lock_guard l1(expected_value.mutex_, std::adopt_lock);
+    private_::pair_lock_guard<lock_type, lock_type>
+      l(this->get_lock(), expected_value.get_lock());
     opaque_t expected_opaque = expected_value.ptr_.load(); // assume stable
     opaque_t desired_opaque = desired_value.ptr_.load();
     if (!ptr_.compare_exchange_strong(expected_opaque, desired_opaque))
@@ -248,23 +440,70 @@ public:
     if (expected_ptr == desired_ptr)
       // self-exchange
       return true;
-    if (desired_ptr)
-      desired_ptr->inc();
+    desired_value.ptr_.store(opaque_t(nullptr));
     if (expected_ptr && expected_ptr->dec())
       delete expected_ptr;
     return true;
   }
 
+  // replaces this ptr w/ desired_value (preserving the mark and tags, as
+  // assignment does), and returns the reference to what it pointed to before
+  inline atomic_ref_ptr
+  exchange(atomic_ref_ptr desired_value)
+  {
+    return atomic_ref_ptr(swap_in(desired_value.take()), adopt_tag());
+  }
+
 private:
+  struct adopt_tag {};
+
+  // takes over a reference to ptr
+  atomic_ref_ptr(T *ptr, adopt_tag) : ptr_(opaque_t(ptr)) {}
+
+  // stores ptr (keeping our mark and tags), and returns the old ptr. the references
+  // change hands along w/ them
+  inline T *
+  swap_in(T *ptr)
+  {
+    std::lock_guard<lock_type> l(this->get_lock());
+    opaque_t this_opaque = get_raw();
+    while (!ptr_.compare_exchange_weak(
+             this_opaque, this->BuildOpaque(ptr, this_opaque)))
+      nop_pause();
+    return this->Ptr(this_opaque);
+  }
+
+  // hands our reference to the caller, leaving us null. we must not be in
+  // use by anyone else (we're the source of a move, or a by-value
+  // parameter), so this doesn't need the lock, which we may share w/ other
+  // ptrs, nor a CAS
+  inline T *
+  take()
+  {
+    const opaque_t this_opaque = ptr_.load(std::memory_order_relaxed);
+    ptr_.store(this->BuildOpaque(nullptr, this_opaque),
+               std::memory_order_relaxed);
+    return this->Ptr(this_opaque);
+  }
+
+  // takes over a reference to ptr
+  inline void
+  assign(T *ptr)
+  {
+    T *const old = swap_in(ptr);
+    // if old == ptr, we held two references to it now
+    if (old && old->dec())
+      delete old;
+  }
 
   template <typename U, typename V>
   void
   assignFrom(const atomic_ref_ptr<U, V> &other)
   {
   retry:
-    std::lock(mutex_, other.mutex_);
-    lock_guard l0(mutex_, std::adopt_lock);
-    typename atomic_ref_ptr<U, V>::lock_guard l1(other.mutex_, std::adopt_lock);
+    private_::pair_lock_guard<
+      lock_type, typename atomic_ref_ptr<U, V>::lock_type>
+      l(this->get_lock(), other.get_lock());
 
     opaque_t this_opaque = get_raw();
     T *this_ptr = this->Ptr(this_opaque);
@@ -285,16 +524,10 @@ private:
       delete this_ptr;
   }
 
-  inline opaque_t
-  get_raw() const
-  {
-    return ptr_.load();
-  }
-
   std::atomic<opaque_t> ptr_;
 
-  // this spinlock guards Ptr(ptr_) from changing (marks can change w/o grabing
-  // mutex)
+  // our lock (see ref_ptr_lock) guards Ptr(ptr_) from changing (marks can
+  // change w/o grabing it)
   //
   // Why do we need a mutex for ref counting? This is because we assume
   // that the source of a copy assignment (ie v in p = v) is un-stable,
@@ -305,5 +538,700 @@ private:
   // That is, it is not possible to do a load() from the source followed by
   // an increment of the reference count *atomically* w/o a lock. Thus, we
   // need a lock to allow us to atomically load and increment.
-  mutable lock_type mutex_;
+};
+
+namespace private_ {
+
+// the ptr, its mark, and a 16-bit external count packed into one word, which
+// assumes 48-bit user space addresses (as on x86-64). there's no room for a
+// version, which is always 0
+class split_word {
+  static const unsigned int CountShift = 48;
+  static const uintptr_t CountMask = ~((uintptr_t(1) << CountShift) - 1);
+
+  static_assert(sizeof(uintptr_t) == 8, "split counts need 64-bit words");
+
+public:
+  typedef uintptr_t value_t;
+
+  static const uint32_t MaxCount = 0xffff;
+  static const bool IsLockFree = true;
+
+  explicit split_word(value_t v) : w_(v) {}
+
+  inline value_t
+  load() const
+  {
+    return w_.load();
+  }
+
+  // Bits(load())
+  inline uintptr_t
+  load_bits() const
+  {
+    return Bits(w_.load());
+  }
+
+  // only for a word nobody else uses
+  inline value_t
+  load_unshared() const
+  {
+    return w_.load(std::memory_order_relaxed);
+  }
+
+  inline void
+  store_unshared(value_t v)
+  {
+    w_.store(v, std::memory_order_relaxed);
+  }
+
+  // on failure, expected is updated to the current value
+  inline bool
+  cas(value_t &expected, value_t desired)
+  {
+    return w_.compare_exchange_weak(expected, desired);
+  }
+
+  static inline value_t
+  Make(uintptr_t bits, uint32_t count, uint32_t)
+  {
+    assert(!(bits & CountMask));
+    return bits | (value_t(count) << CountShift);
+  }
+
+  // the ptr and its mark
+  static inline uintptr_t
+  Bits(value_t v)
+  {
+    return v & ~CountMask;
+  }
+
+  static inline uint32_t
+  Count(value_t v)
+  {
+    return v >> CountShift;
+  }
+
+  static inline uint32_t
+  Version(value_t)
+  {
+    return 0;
+  }
+
+private:
+  std::atomic<value_t> w_;
+};
+
+// the ptr and its mark in the low word, and a 32-bit external count and a
+// 32-bit version in the high one, CASed together w/ cmpxchg16b. targets
+// w/o a double-width CAS (or builds w/o -mcx16) get a spinlock per word
+// instead, which keeps the semantics, but of course isn't lock-free
+class tagged_word {
+public:
+  typedef unsigned __int128 value_t;
+
+  static const uint32_t MaxCount = 0xffffffff;
+
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_16
+  static const bool IsLockFree = true;
+
+  explicit tagged_word(value_t v) : w_(v) {}
+
+  inline value_t
+  load() const
+  {
+    // there's no plain 16-byte atomic load, so CAS 0 w/ itself
+    return __sync_val_compare_and_swap(&w_, value_t(0), value_t(0));
+  }
+
+  // Bits(load()). the ptr and its mark are all in the low word, which a
+  // plain 8-byte load reads atomically, w/o writing the cache line as the
+  // CAS in load() does
+  inline uintptr_t
+  load_bits() const
+  {
+    static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+                  "the low word has to come first");
+    return __atomic_load_n(reinterpret_cast<const uintptr_t *>(&w_),
+                           __ATOMIC_SEQ_CST);
+  }
+
+  // only for a word nobody else uses
+  inline value_t
+  load_unshared() const
+  {
+    return w_;
+  }
+
+  inline void
+  store_unshared(value_t v)
+  {
+    w_ = v;
+  }
+
+  inline bool
+  cas(value_t &expected, value_t desired)
+  {
+    const value_t prev = __sync_val_compare_and_swap(&w_, expected, desired);
+    if (prev == expected)
+      return true;
+    expected = prev;
+    return false;
+  }
+
+private:
+  mutable value_t w_;
+#else
+  static const bool IsLockFree = false;
+
+  explicit tagged_word(value_t v) : w_(v), mutex_() {}
+
+  inline value_t
+  load() const
+  {
+    std::lock_guard<spinlock> l(mutex_);
+    return w_;
+  }
+
+  inline uintptr_t
+  load_bits() const
+  {
+    return Bits(load());
+  }
+
+  inline value_t
+  load_unshared() const
+  {
+    return w_;
+  }
+
+  inline void
+  store_unshared(value_t v)
+  {
+    w_ = v;
+  }
+
+  inline bool
+  cas(value_t &expected, value_t desired)
+  {
+    std::lock_guard<spinlock> l(mutex_);
+    if (w_ != expected) {
+      expected = w_;
+      return false;
+    }
+    w_ = desired;
+    return true;
+  }
+
+private:
+  value_t w_;
+  mutable spinlock mutex_;
+#endif
+
+public:
+  static inline value_t
+  Make(uintptr_t bits, uint32_t count, uint32_t version)
+  {
+    return value_t(bits) | (value_t(count) << 64) | (value_t(version) << 96);
+  }
+
+  static inline uintptr_t
+  Bits(value_t v)
+  {
+    return uintptr_t(v);
+  }
+
+  static inline uint32_t
+  Count(value_t v)
+  {
+    return uint32_t(v >> 64);
+  }
+
+  static inline uint32_t
+  Version(value_t v)
+  {
+    return uint32_t(v >> 96);
+  }
+};
+
+template <typename Word>
+struct split_ref_count_impl {};
+
+}
+
+// use as atomic_ref_ptr's LockImpl to get a lock-free atomic_ref_ptr w/ split
+// reference counts instead. tagged_ref_count also versions the ptr, for
+// ABA-safe compare_exchange_strong() on snapshots
+typedef private_::split_ref_count_impl<private_::split_word> split_ref_count;
+typedef private_::split_ref_count_impl<private_::tagged_word> tagged_ref_count;
+
+/**
+ * Lock-free atomic_ref_ptr w/ split reference counts (see Williams, C++
+ * Concurrency in Action, ch 7.2.4).
+ *
+ * Next to the ptr and its mark, each atomic_ref_ptr keeps an external count
+ * in the same (possibly double-width) word. Loading and incrementing is done
+ * in two steps: bump the external count w/ a CAS, which keeps the object
+ * alive as long as the atomic_ref_ptr points to it, then increment the
+ * object's count, and give the external one back. The count of the object
+ * itself includes one reference for every atomic_ref_ptr pointing to it.
+ * Whoever replaces the ptr moves the external count still held by readers
+ * into the object's count (RefCountImpl::transfer()), and readers which find
+ * theirs moved drop their unit from the object's count instead.
+ *
+ * W/ a word which has room for it, every change to the ptr or its mark also
+ * bumps a version, so a snapshot can't be mistaken for a later value w/ the
+ * same ptr and mark.
+ *
+ * Same interface and marking semantics as atomic_ref_ptr
+ */
+template <typename T, typename Word>
+class atomic_ref_ptr<T, private_::split_ref_count_impl<Word>>
+  : public private_::ptr_ops_mixin<T> {
+  template <typename U, typename V> friend class atomic_ref_ptr;
+
+  typedef typename Word::value_t value_t;
+
+public:
+  typedef typename private_::ptr_ops_mixin<T>::opaque_t opaque_t;
+
+  static const bool IsLockFree = Word::IsLockFree;
+
+  atomic_ref_ptr() : ptr_(0) {}
+
+  ~atomic_ref_ptr()
+  {
+    // nobody can be loading from us anymore, since they'd need a reference
+    // to whatever contains us
+    release(ptr_.load());
+  }
+
+  explicit atomic_ref_ptr(T *ptr)
+    : ptr_(Word::Make(uintptr_t(ptr), 0, 0))
+  {
+    if (ptr)
+      ptr->inc();
+  }
+
+  template <typename U>
+  explicit atomic_ref_ptr(U *ptr)
+    : ptr_(Word::Make(uintptr_t(static_cast<T *>(ptr)), 0, 0))
+  {
+    if (ptr)
+      ptr->inc();
+  }
+
+  atomic_ref_ptr(const atomic_ref_ptr &other)
+    : ptr_(Word::Make(uintptr_t(other.acquire()), 0, 0)) {}
+
+  template <typename U>
+  atomic_ref_ptr(
+      const atomic_ref_ptr<U, private_::split_ref_count_impl<Word>> &other)
+    : ptr_(Word::Make(uintptr_t(static_cast<T *>(other.acquire())), 0, 0)) {}
+
+  atomic_ref_ptr &
+  operator=(const atomic_ref_ptr &other)
+  {
+    assign(other.acquire());
+    return *this;
+  }
+
+  template <typename U>
+  atomic_ref_ptr &
+  operator=(
+      const atomic_ref_ptr<U, private_::split_ref_count_impl<Word>> &other)
+  {
+    assign(static_cast<T *>(other.acquire()));
+    return *this;
+  }
+
+  // other must not be in use by anyone else
+  atomic_ref_ptr(atomic_ref_ptr &&other)
+    : ptr_(Word::Make(uintptr_t(other.take()), 0, 0)) {}
+
+  atomic_ref_ptr &
+  operator=(atomic_ref_ptr &&other)
+  {
+    assign(other.take());
+    return *this;
+  }
+
+  explicit inline
+  operator bool() const
+  {
+    return get();
+  }
+
+  T &
+  operator*() const
+  {
+    return *get();
+  }
+
+  T *
+  operator->() const
+  {
+    return get();
+  }
+
+  template <typename U, typename V>
+  inline bool
+  operator==(const atomic_ref_ptr<U, V> &other) const
+  {
+    return get() == other.get();
+  }
+
+  template <typename U, typename V>
+  inline bool
+  operator!=(const atomic_ref_ptr<U, V> &other) const
+  {
+    return !operator==(other);
+  }
+
+  inline T *
+  get() const
+  {
+    return this->Ptr(get_raw());
+  }
+
+  inline bool
+  get_mark() const
+  {
+    return this->IsMarked(get_raw());
+  }
+
+  // the ptr and its mark, read at once (w/o the count and version, which
+  // saves tagged_ref_count a double-width CAS)
+  inline opaque_t
+  get_raw() const
+  {
+    return opaque_t(ptr_.load_bits());
+  }
+
+  // the ptr, its mark, and its version, read at once. the version is always
+  // 0 w/ split_ref_count
+  struct snapshot {
+    opaque_t raw;
+    uint32_t version;
+  };
+
+  inline snapshot
+  get_snapshot() const
+  {
+    const value_t v = ptr_.load();
+    return snapshot{opaque_t(Word::Bits(v)), Word::Version(v)};
+  }
+
+  inline bool
+  mark()
+  {
+    value_t v = ptr_.load();
+    for (;;) {
+      if (Word::Bits(v) & 0x1)
+        return false;
+      if (ptr_.cas(v, Word::Make(Word::Bits(v) | 0x1, Word::Count(v),
+                                 Word::Version(v) + 1)))
+        return true;
+      nop_pause();
+    }
+  }
+
+  // see the generic atomic_ref_ptr for tags. changing one bumps the version
+
+  template <unsigned int Tag>
+  inline bool
+  test_tag() const
+  {
+    return get_raw() & this->template TagBit<Tag>();
+  }
+
+  template <unsigned int Tag>
+  inline bool
+  set_tag()
+  {
+    const uintptr_t bit = this->template TagBit<Tag>();
+    return update_bits([bit](uintptr_t b) { return b & bit ? b : b | bit; });
+  }
+
+  template <unsigned int Tag>
+  inline bool
+  clear_tag()
+  {
+    const uintptr_t bit = this->template TagBit<Tag>();
+    return update_bits([bit](uintptr_t b) { return b & bit ? b & ~bit : b; });
+  }
+
+  template <unsigned int Tag>
+  inline bool
+  compare_exchange_tag(opaque_t expected_raw, bool desired)
+  {
+    const uintptr_t bit = this->template TagBit<Tag>();
+    const uintptr_t expected = uintptr_t(expected_raw);
+    return update_bits([bit, expected, desired](uintptr_t b) {
+        return b != expected ? b : desired ? b | bit : b & ~bit;
+      });
+  }
+
+  // fails if this ptr was marked, or points elsewhere
+  inline bool
+  compare_exchange_strong(
+      const atomic_ref_ptr &expected_value,
+      atomic_ref_ptr desired_value)
+  {
+    const uintptr_t expected = expected_value.ptr_.load_bits();
+    return exchange_if(
+        [expected](value_t v) { return Word::Bits(v) == expected; },
+        desired_value);
+  }
+
+  // fails if this ptr (or its mark) has changed since the snapshot was
+  // taken, even if it was changed back since. split_ref_count has no
+  // version, so it can only tell the former
+  inline bool
+  compare_exchange_strong(
+      const snapshot &expected,
+      atomic_ref_ptr desired_value)
+  {
+    return exchange_if(
+        [&expected](value_t v) {
+          return Word::Bits(v) == uintptr_t(expected.raw) &&
+                 Word::Version(v) == expected.version;
+        },
+        desired_value);
+  }
+
+  // replaces this ptr w/ desired_value, preserving the mark and tags, and
+  // returns the reference to what it pointed to before
+  inline atomic_ref_ptr
+  exchange(atomic_ref_ptr desired_value)
+  {
+    return atomic_ref_ptr(swap_in(desired_value.take()), adopt_tag());
+  }
+
+private:
+  struct adopt_tag {};
+
+  // takes over a reference to p
+  atomic_ref_ptr(T *p, adopt_tag) : ptr_(Word::Make(uintptr_t(p), 0, 0)) {}
+
+  static inline T *
+  PtrOf(value_t v)
+  {
+    return private_::ptr_ops_mixin<T>::Ptr(opaque_t(Word::Bits(v)));
+  }
+
+  static inline uintptr_t
+  TagsOf(value_t v)
+  {
+    return Word::Bits(v) & uintptr_t(private_::ptr_ops_mixin<T>::TagMask());
+  }
+
+  // replaces the ptr's bits w/ f(bits), keeping the count. returns false if
+  // that didn't change anything
+  template <typename F>
+  inline bool
+  update_bits(F f)
+  {
+    value_t v = ptr_.load();
+    for (;;) {
+      const uintptr_t b = f(uintptr_t(Word::Bits(v)));
+      if (b == Word::Bits(v))
+        return false;
+      if (ptr_.cas(v, Word::Make(b, Word::Count(v), Word::Version(v) + 1)))
+        return true;
+    }
+  }
+
+  // stores p (keeping our mark and tags), and returns the old ptr, w/ the
+  // reference ptr_ held to it. p's reference is taken over
+  inline T *
+  swap_in(T *p)
+  {
+    value_t v = ptr_.load();
+    while (!ptr_.cas(v, Word::Make(uintptr_t(p) | TagsOf(v), 0,
+                                   Word::Version(v) + 1)))
+      nop_pause();
+    return Fold(v);
+  }
+
+  // hands our reference to the caller, leaving us null. we must not be in
+  // use by anyone else (see the generic atomic_ref_ptr), so there's no need
+  // for a CAS
+  inline T *
+  take()
+  {
+    const value_t v = ptr_.load_unshared();
+    ptr_.store_unshared(Word::Make(TagsOf(v), 0, Word::Version(v) + 1));
+    return Fold(v);
+  }
+
+  // returns the ptr of an old value of ptr_, w/ the reference ptr_ held to
+  // it. the external count readers didn't give back is folded into that
+  static inline T *
+  Fold(value_t v)
+  {
+    T *const p = PtrOf(v);
+    if (p && Word::Count(v)) {
+      const bool last = p->transfer(Word::Count(v) + 1);
+      assert(!last); (void) last;
+    }
+    return p;
+  }
+
+  // drops the reference of an old value of ptr_, along w/ the external
+  // count readers didn't give back
+  static inline void
+  release(value_t v)
+  {
+    T *const p = PtrOf(v);
+    if (p && p->transfer(Word::Count(v)))
+      delete p;
+  }
+
+  // replaces ptr_ w/ desired_value (unmarked) if matches(ptr_), and takes
+  // over its reference on success. desired_value is one of our by-value
+  // parameters
+  template <typename Pred>
+  inline bool
+  exchange_if(Pred matches, atomic_ref_ptr &desired_value)
+  {
+    // ptr_'s reference has to be there as soon as it points to p, someone
+    // could replace it right away
+    T *const p = desired_value.take();
+    value_t v = ptr_.load();
+    for (;;) {
+      if (!matches(v)) {
+        // give it back, it's dropped along w/ desired_value
+        desired_value.ptr_.store_unshared(Word::Make(uintptr_t(p), 0, 0));
+        return false;
+      }
+      if (ptr_.cas(v, Word::Make(uintptr_t(p), 0, Word::Version(v) + 1)))
+        break;
+    }
+    release(v);
+    return true;
+  }
+
+  // loads the ptr, and returns it w/ a new reference
+  T *
+  acquire() const
+  {
+    value_t v = ptr_.load();
+    value_t nv;
+    for (;;) {
+      if (!PtrOf(v))
+        return nullptr;
+      if (unlikely(Word::Count(v) == Word::MaxCount)) {
+        // too many concurrent readers
+        nop_pause();
+        v = ptr_.load();
+        continue;
+      }
+      nv = Word::Make(Word::Bits(v), Word::Count(v) + 1, Word::Version(v));
+      if (ptr_.cas(v, nv))
+        break;
+    }
+    T *const p = PtrOf(nv);
+    p->inc();
+
+    // give our external unit back, unless it was moved into p's count (by
+    // whoever replaced p), in which case we drop it from there. p may well
+    // have come back w/ a fresh external count by now, but units are
+    // interchangeable
+    v = nv;
+    for (;;) {
+      if (PtrOf(v) != p || !Word::Count(v)) {
+        const bool last = p->dec();
+        assert(!last); (void) last;
+        break;
+      }
+      if (ptr_.cas(v, Word::Make(Word::Bits(v), Word::Count(v) - 1,
+                                 Word::Version(v))))
+        break;
+    }
+    return p;
+  }
+
+  // takes over a reference to p
+  void
+  assign(T *p)
+  {
+    value_t v = ptr_.load();
+    for (;;) {
+      if (PtrOf(v) == p) {
+        // self-assignment. ptr_ may have moved on in the meantime, so ours
+        // might be the last reference by now
+        if (p && p->dec())
+          delete p;
+        return;
+      }
+      if (ptr_.cas(v, Word::Make(uintptr_t(p) | TagsOf(v), 0,
+                                 Word::Version(v) + 1)))
+        break;
+    }
+    release(v);
+  }
+
+  mutable Word ptr_;
+};
+
+// a plain ptr read out of an atomic_ref_ptr, w/o taking a reference. only
+// useful while something else keeps the object alive (an rcu region, a
+// hazard ptr), but copying one doesn't touch the object's count
+template <typename T>
+class guarded_ptr {
+public:
+  guarded_ptr() : ptr_(nullptr) {}
+
+  explicit guarded_ptr(T *ptr) : ptr_(ptr) {}
+
+  template <typename V>
+  guarded_ptr(const atomic_ref_ptr<T, V> &p) : ptr_(p.get()) {}
+
+  template <typename V>
+  guarded_ptr &
+  operator=(const atomic_ref_ptr<T, V> &p)
+  {
+    ptr_ = p.get();
+    return *this;
+  }
+
+  explicit inline
+  operator bool() const
+  {
+    return ptr_;
+  }
+
+  T &
+  operator*() const
+  {
+    return *ptr_;
+  }
+
+  T *
+  operator->() const
+  {
+    return ptr_;
+  }
+
+  inline bool
+  operator==(const guarded_ptr &other) const
+  {
+    return ptr_ == other.ptr_;
+  }
+
+  inline bool
+  operator!=(const guarded_ptr &other) const
+  {
+    return !operator==(other);
+  }
+
+  inline T *
+  get() const
+  {
+    return ptr_;
+  }
+
+private:
+  T *ptr_;
 };
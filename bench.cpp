@@ -19,6 +19,7 @@ using namespace std;
 static int g_verbose = false;
 static size_t g_nthreads = 1;
 static uint64_t g_duration_sec = 10;
+static unsigned int g_rcu_reclaimers = 0;
 
 static void
 _die(const char *filename,
@@ -37,6 +38,37 @@ _die(const char *filename,
 
 #define die(x) _die(__FILE__, __func__, __LINE__, x)
 
+static void
+print_histogram(const string &name, const rcu_domain::histogram &h)
+{
+  cout << "  " << name << ": count " << h.count << ", avg "
+       << (h.count ? double(h.sum) / double(h.count) : 0.0)
+       << ", max " << h.max << endl;
+  for (unsigned int i = 0; i < rcu_domain::histogram::NBuckets; i++)
+    if (h.buckets[i])
+      cout << "    < " << (uint64_t(1) << i) << " : " << h.buckets[i] << endl;
+}
+
+static void
+print_rcu_stats(rcu_domain &d)
+{
+  const rcu_domain::stats s = d.get_stats();
+  cout << "rcu stats:" << endl
+       << "  global epoch       : " << s.global_epoch << endl
+       << "  grace periods      : " << s.grace_periods << endl
+       << "  stalls             : " << s.stalls << endl
+       << "  deferred objs      : " << s.deferred_objs << endl
+       << "  deferred bytes     : " << s.deferred_bytes << endl
+       << "  backpressure events: " << s.backpressure_events << endl;
+  print_histogram("grace period (us)", s.gp_us);
+  print_histogram("reader wait (us)", s.reader_wait_us);
+  print_histogram("deletes per grace period", s.deletes_per_gp);
+  cout << "  claimed per thread (last grace period):";
+  for (auto n : s.claimed_per_thread)
+    cout << " " << n;
+  cout << endl;
+}
+
 class worker {
   friend class benchmark;
 public:
@@ -66,6 +98,8 @@ class benchmark {
 public:
   virtual ~benchmark() {}
 
+  virtual size_t bytes_per_elem() const = 0;
+
   void
   do_bench()
   {
@@ -129,6 +163,13 @@ class read_only_benchmark : public benchmark {
     size_t nelems_seen;
   };
 
+public:
+  size_t
+  bytes_per_elem() const OVERRIDE
+  {
+    return llist::bytes_per_elem();
+  }
+
 protected:
   void
   init() OVERRIDE
@@ -149,7 +190,7 @@ protected:
     vector<unique_ptr<worker>> ret;
     for (size_t i = 0; i < g_nthreads; i++)
       ret.emplace_back(new ro_worker(&list));
-    return move(ret);
+    return ret;
   }
 
 private:
@@ -197,6 +238,13 @@ class queue_benchmark : public benchmark {
     size_t nelems_popped;
   };
 
+public:
+  size_t
+  bytes_per_elem() const OVERRIDE
+  {
+    return llist::bytes_per_elem();
+  }
+
 protected:
   void
   init() OVERRIDE
@@ -219,7 +267,7 @@ protected:
       ret.emplace_back(new producer(&list));
     for (size_t i = g_nthreads / 2; i < g_nthreads; i++)
       ret.emplace_back(new consumer(&list));
-    return move(ret);
+    return ret;
   }
 
 private:
@@ -243,10 +291,11 @@ main(int argc, char **argv)
       {"policy",       required_argument, 0,         'p'},
       {"num-threads",  required_argument, 0,         't'},
       {"runtime",      required_argument, 0,         'r'},
+      {"rcu-reclaimers", required_argument, 0,       'c'},
       {0, 0, 0, 0}
     };
     int option_index = 0;
-    int c = getopt_long(argc, argv, "vb:t:r:", long_options, &option_index);
+    int c = getopt_long(argc, argv, "vb:t:r:c:", long_options, &option_index);
     if (c == -1)
       break;
 
@@ -277,6 +326,10 @@ main(int argc, char **argv)
         die("need --runtime > 0");
       break;
 
+    case 'c':
+      g_rcu_reclaimers = strtoul(optarg, NULL, 10);
+      break;
+
     case '?':
       /* getopt_long already printed an error message. */
       break;
@@ -289,7 +342,10 @@ main(int argc, char **argv)
   const set<string> valid_bench_types =
     {"readonly", "queue"};
   const set<string> valid_policy_types =
-    {"global_lock", "per_node_lock", "lock_free", "lock_free_rcu"};
+    {"global_lock", "per_node_lock", "lock_free", "lock_free_split",
+     "lock_free_tagged", "lock_free_striped", "lock_free_biased",
+     "lock_free_deferred", "lock_free_rcu", "lock_free_rcu_pool", "lock_free_hp",
+     "lock_free_ebr"};
 
   if (!valid_bench_types.count(bench_type))
     die("invalid --bench");
@@ -297,6 +353,12 @@ main(int argc, char **argv)
   if (!valid_policy_types.count(policy_type))
     die("invalid --policy");
 
+  {
+    rcu::gc_policy p = rcu::get_gc_policy();
+    p.nreclaimers = g_rcu_reclaimers;
+    rcu::set_gc_policy(p);
+  }
+
   unique_ptr<benchmark> p;
 
   // XXX(stephentu): there must be a better way to do this, but leave it for
@@ -308,8 +370,24 @@ main(int argc, char **argv)
       p.reset(new read_only_benchmark<typename ll_policy<int>::per_node_lock>);
     else if (policy_type == "lock_free")
       p.reset(new read_only_benchmark<typename ll_policy<int>::lock_free>);
+    else if (policy_type == "lock_free_split")
+      p.reset(new read_only_benchmark<typename ll_policy<int>::lock_free_split>);
+    else if (policy_type == "lock_free_tagged")
+      p.reset(new read_only_benchmark<typename ll_policy<int>::lock_free_tagged>);
+    else if (policy_type == "lock_free_striped")
+      p.reset(new read_only_benchmark<typename ll_policy<int>::lock_free_striped>);
+    else if (policy_type == "lock_free_biased")
+      p.reset(new read_only_benchmark<typename ll_policy<int>::lock_free_biased>);
+    else if (policy_type == "lock_free_deferred")
+      p.reset(new read_only_benchmark<typename ll_policy<int>::lock_free_deferred>);
     else if (policy_type == "lock_free_rcu")
       p.reset(new read_only_benchmark<typename ll_policy<int>::lock_free_rcu>);
+    else if (policy_type == "lock_free_rcu_pool")
+      p.reset(new read_only_benchmark<typename ll_policy<int>::lock_free_rcu_pool>);
+    else if (policy_type == "lock_free_hp")
+      p.reset(new read_only_benchmark<typename ll_policy<int>::lock_free_hp>);
+    else if (policy_type == "lock_free_ebr")
+      p.reset(new read_only_benchmark<typename ll_policy<int>::lock_free_ebr>);
   } else if (bench_type == "queue") {
     if (policy_type == "global_lock")
       p.reset(new queue_benchmark<typename ll_policy<int>::global_lock>);
@@ -317,8 +395,24 @@ main(int argc, char **argv)
       p.reset(new queue_benchmark<typename ll_policy<int>::per_node_lock>);
     else if (policy_type == "lock_free")
       p.reset(new queue_benchmark<typename ll_policy<int>::lock_free>);
+    else if (policy_type == "lock_free_split")
+      p.reset(new queue_benchmark<typename ll_policy<int>::lock_free_split>);
+    else if (policy_type == "lock_free_tagged")
+      p.reset(new queue_benchmark<typename ll_policy<int>::lock_free_tagged>);
+    else if (policy_type == "lock_free_striped")
+      p.reset(new queue_benchmark<typename ll_policy<int>::lock_free_striped>);
+    else if (policy_type == "lock_free_biased")
+      p.reset(new queue_benchmark<typename ll_policy<int>::lock_free_biased>);
+    else if (policy_type == "lock_free_deferred")
+      p.reset(new queue_benchmark<typename ll_policy<int>::lock_free_deferred>);
     else if (policy_type == "lock_free_rcu")
       p.reset(new queue_benchmark<typename ll_policy<int>::lock_free_rcu>);
+    else if (policy_type == "lock_free_rcu_pool")
+      p.reset(new queue_benchmark<typename ll_policy<int>::lock_free_rcu_pool>);
+    else if (policy_type == "lock_free_hp")
+      p.reset(new queue_benchmark<typename ll_policy<int>::lock_free_hp>);
+    else if (policy_type == "lock_free_ebr")
+      p.reset(new queue_benchmark<typename ll_policy<int>::lock_free_ebr>);
   }
 
   if (g_verbose) {
@@ -326,9 +420,18 @@ main(int argc, char **argv)
          << "  bench      : " << bench_type << endl
          << "  policy     : " << policy_type << endl
          << "  num-threads: " << g_nthreads << endl
-         << "  runtime    : " << g_duration_sec << " sec" << endl;
+         << "  runtime    : " << g_duration_sec << " sec" << endl
+         << "  rcu-reclaimers: " << g_rcu_reclaimers << endl
+         << "  bytes/element: " << p->bytes_per_elem() << endl;
   }
 
   p->do_bench();
+
+  if (g_verbose) {
+    if (policy_type == "lock_free_rcu" || policy_type == "lock_free_rcu_pool")
+      print_rcu_stats(rcu::domain());
+    else if (policy_type == "lock_free_ebr")
+      print_rcu_stats(inline_rcu_domain::get());
+  }
   return 0;
 }
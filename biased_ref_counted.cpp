@@ -0,0 +1,147 @@
+#include <cassert>
+#include <mutex>
+
+#include "biased_ref_counted.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+const int64_t biased_ref_counted::Merged;
+const int64_t biased_ref_counted::Queued;
+const int64_t biased_ref_counted::One;
+
+__thread biased_ref_counted::record *biased_ref_counted::tl_record = nullptr;
+
+pthread_once_t biased_ref_counted::thread_key_once = PTHREAD_ONCE_INIT;
+pthread_key_t biased_ref_counted::thread_key;
+
+atomic<biased_ref_counted::record *> biased_ref_counted::records(nullptr);
+
+bool
+biased_ref_counted::owner_merge()
+{
+  // set before anybody else can drop the last reference
+  merged_ = true;
+  int64_t v = shared_.load();
+  for (;;) {
+    if (v & Queued) {
+      // merging is up to whoever handles our queue now
+      merged_ = false;
+      return false;
+    }
+    const int64_t n = (v + int64_t(biased_) * One) | Merged;
+    if (shared_.compare_exchange_weak(v, n))
+      return Count(n) == 0;
+  }
+}
+
+bool
+biased_ref_counted::shared_dec()
+{
+  int64_t v = shared_.load();
+  if (v & Merged)
+    return Count(shared_.fetch_sub(One) - One) == 0;
+  for (;;) {
+    int64_t n = v - One;
+    // only the owner can tell whether this was the last reference
+    const bool queue = !(v & (Merged | Queued)) && Count(n) < 0;
+    if (queue)
+      n |= Queued;
+    if (shared_.compare_exchange_weak(v, n)) {
+      if (!queue)
+        return (n & Merged) && Count(n) == 0;
+      break;
+    }
+  }
+
+  record &r = *owner_;
+  lock_guard<spinlock> l(r.mutex);
+  if (!r.in_use.load(memory_order_relaxed))
+    // the owner is gone, so its count doesn't change anymore
+    return merge();
+  r.queued.push_back(this);
+  r.pending.store(true, memory_order_relaxed);
+  return false;
+}
+
+bool
+biased_ref_counted::merge()
+{
+  merged_ = true;
+  const int64_t d = int64_t(biased_) * One + Merged;
+  return Count(shared_.fetch_add(d) + d) == 0;
+}
+
+void
+biased_ref_counted::merge_queued(record &r)
+{
+  // freeing objects can drop more references, and queue more of them
+  if (r.merging)
+    return;
+  r.merging = true;
+  for (;;) {
+    vector<biased_ref_counted *> queued;
+    {
+      lock_guard<spinlock> l(r.mutex);
+      queued.swap(r.queued);
+      r.pending.store(false, memory_order_relaxed);
+    }
+    if (queued.empty())
+      break;
+    for (auto p : queued)
+      if (p->merge())
+        delete p;
+  }
+  r.merging = false;
+}
+
+void
+biased_ref_counted::make_thread_key()
+{
+  const int ret = pthread_key_create(&thread_key, thread_exit);
+  ASSERT(!ret);
+}
+
+void
+biased_ref_counted::acquire_record()
+{
+  pthread_once(&thread_key_once, make_thread_key);
+  record *r;
+  for (r = records.load(memory_order_acquire); r; r = r->next) {
+    if (r->in_use.load(memory_order_relaxed))
+      continue;
+    // a record changes hands under its mutex, see shared_dec()
+    lock_guard<spinlock> l(r->mutex);
+    if (!r->in_use.load(memory_order_relaxed)) {
+      r->in_use.store(true, memory_order_relaxed);
+      break;
+    }
+  }
+  if (!r) {
+    r = &cache_aligned_new<aligned_padded_elem<record>>()->elem;
+    r->in_use.store(true, memory_order_relaxed);
+    r->next = records.load(memory_order_relaxed);
+    while (!records.compare_exchange_weak(r->next, r))
+      nop_pause();
+  }
+  tl_record = r;
+  const int ret = pthread_setspecific(thread_key, r);
+  ASSERT(!ret);
+}
+
+void
+biased_ref_counted::thread_exit(void *p)
+{
+  record *r = (record *) p;
+  assert(r == tl_record);
+  for (;;) {
+    merge_queued(*r);
+    lock_guard<spinlock> l(r->mutex);
+    if (r->queued.empty()) {
+      // from now on, objects we own are merged by whoever queues them
+      r->in_use.store(false, memory_order_relaxed);
+      break;
+    }
+  }
+  tl_record = nullptr;
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <vector>
+#include <pthread.h>
+
+#include "macros.hpp"
+#include "spinlock.hpp"
+
+/**
+ * Biased reference counting (Choi et al., 2018), a drop-in RefCountImpl for
+ * lock_free_impl.
+ *
+ * An object is owned by the thread which created it. The owner counts its
+ * references in a plain int (biased_), everybody else in an atomic one
+ * (shared_), so the object is alive as long as the sum of both is positive.
+ * Once the owner's count drops to 0, it merges it into the shared one, and
+ * the object is reference counted the usual way from then on.
+ *
+ * Only the owner can tell whether the object is dead before that, so a
+ * non-owner which takes the shared count below 0 (it drops references the
+ * owner took) queues the object with its owner, which merges it the next
+ * time it drops a reference, or when it exits. If the owner is gone already,
+ * the non-owner merges it itself.
+ *
+ * Objects need a virtual destructor, because merging queued objects can free
+ * them from a thread which doesn't know their type.
+ */
+class biased_ref_counted {
+public:
+  struct record {
+    record()
+      : in_use(false), pending(false), merging(false), queued(),
+        next(nullptr) {}
+    record(const record &) = delete;
+    record &operator=(const record &) = delete;
+
+    spinlock mutex; // protects in_use (writes) and queued
+    std::atomic<bool> in_use;
+    std::atomic<bool> pending; // queued isn't empty
+
+    // only touched by the owner
+    bool merging;
+
+    std::vector<biased_ref_counted *> queued;
+
+    record *next; // records are never deallocated, only recycled
+  };
+
+protected:
+  // construction does NOT increment reference count
+  biased_ref_counted()
+    : owner_(&record_for_thread()), biased_(0), merged_(false), shared_(0) {}
+  virtual ~biased_ref_counted() {}
+
+public:
+  inline void
+  inc()
+  {
+    if (is_owner())
+      biased_++;
+    else
+      shared_.fetch_add(One);
+  }
+
+  // returns true if last decrement
+  inline bool
+  dec()
+  {
+    record *const me = tl_record;
+    if (unlikely(me && me->pending.load(std::memory_order_relaxed)))
+      merge_queued(*me);
+    if (is_owner()) {
+      if (likely(--biased_ > 0))
+        return false;
+      return owner_merge();
+    }
+    return shared_dec();
+  }
+
+  // adds n references, and drops one (n may be 0). returns true if that
+  // dropped the last one
+  inline bool
+  transfer(uint32_t n)
+  {
+    if (is_owner())
+      biased_ += n;
+    else if (n)
+      shared_.fetch_add(int64_t(n) * One);
+    return dec();
+  }
+
+private:
+  // shared_ holds the count times One, and these flags
+  static const int64_t Merged = 0x1;
+  static const int64_t Queued = 0x2;
+  static const int64_t One = 0x4;
+
+  static inline int64_t
+  Count(int64_t v)
+  {
+    return (v & ~(Merged | Queued)) / One;
+  }
+
+  inline bool
+  is_owner() const
+  {
+    return owner_ == tl_record && !merged_;
+  }
+
+  bool owner_merge();
+  bool shared_dec();
+  bool merge();
+
+  static void merge_queued(record &r);
+
+  static inline record &
+  record_for_thread()
+  {
+    if (unlikely(!tl_record))
+      acquire_record();
+    return *tl_record;
+  }
+
+  static void acquire_record();
+  static void make_thread_key();
+  static void thread_exit(void *p);
+
+  static __thread record *tl_record;
+
+  static pthread_once_t thread_key_once;
+  static pthread_key_t thread_key;
+
+  static std::atomic<record *> records;
+
+  record *const owner_;
+
+  // only touched by the owner (or by whoever merges us, once it's gone)
+  int32_t biased_;
+  bool merged_;
+
+  std::atomic<int64_t> shared_;
+};
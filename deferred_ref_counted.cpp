@@ -0,0 +1,93 @@
+#include <cassert>
+#include <cstdlib>
+
+#include "deferred_ref_counted.hpp"
+
+using namespace std;
+
+const unsigned int deferred_ref_counted::NSlots;
+
+__thread deferred_ref_counted::buffer *deferred_ref_counted::tl_buffer = nullptr;
+
+pthread_once_t deferred_ref_counted::thread_key_once = PTHREAD_ONCE_INIT;
+pthread_key_t deferred_ref_counted::thread_key;
+
+void
+deferred_ref_counted::defer(deferred_ref_counted *p)
+{
+  buffer &b = buffer_for_thread();
+  entry &e = b.slots[Slot(p)];
+  for (;;) {
+    if (e.obj == p) {
+      e.ndecs++;
+      return;
+    }
+    if (!e.obj) {
+      e.obj = p;
+      e.ndecs = 1;
+      return;
+    }
+    // freeing the evicted object can drop more references, which can end
+    // up in this slot again
+    const entry evicted = e;
+    e.obj = nullptr;
+    apply(evicted);
+  }
+}
+
+void
+deferred_ref_counted::apply(const entry &e)
+{
+  assert(e.obj->count_.load() >= e.ndecs);
+  if (e.obj->count_.fetch_sub(e.ndecs) == e.ndecs)
+    delete e.obj;
+}
+
+void
+deferred_ref_counted::flush()
+{
+  buffer *b = tl_buffer;
+  if (!b)
+    return;
+  // freed objects can buffer more decrements, in slots we already went over
+  for (bool again = true; again;) {
+    again = false;
+    for (unsigned int i = 0; i < NSlots; i++) {
+      if (!b->slots[i].obj)
+        continue;
+      const entry e = b->slots[i];
+      b->slots[i].obj = nullptr;
+      apply(e);
+      again = true;
+    }
+  }
+}
+
+void
+deferred_ref_counted::make_thread_key()
+{
+  const int ret = pthread_key_create(&thread_key, thread_exit);
+  ASSERT(!ret);
+}
+
+deferred_ref_counted::buffer &
+deferred_ref_counted::buffer_for_thread()
+{
+  if (likely(tl_buffer))
+    return *tl_buffer;
+  pthread_once(&thread_key_once, make_thread_key);
+  tl_buffer = new buffer;
+  const int ret = pthread_setspecific(thread_key, tl_buffer);
+  ASSERT(!ret);
+  return *tl_buffer;
+}
+
+void
+deferred_ref_counted::thread_exit(void *p)
+{
+  buffer *b = (buffer *) p;
+  assert(b == tl_buffer);
+  flush();
+  tl_buffer = nullptr;
+  delete b;
+}
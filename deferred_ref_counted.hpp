@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <pthread.h>
+
+#include "macros.hpp"
+
+/**
+ * A RefCountImpl which defers decrements: each thread buffers the references
+ * it drops in a small direct mapped table, and applies them (freeing objects
+ * whose count drops to 0) when an entry gets evicted, on flush(), or when the
+ * thread exits. An increment on an object which the thread has a buffered
+ * decrement for cancels the two out w/o touching the count, so traversals
+ * which keep going over the same nodes (the sentinel head of a list, say)
+ * don't write to them at all.
+ *
+ * Each thread keeps at most NSlots objects alive this way. Objects need a
+ * virtual destructor, because they are freed by code which doesn't know
+ * their type.
+ */
+class deferred_ref_counted {
+protected:
+  // construction does NOT increment reference count
+  deferred_ref_counted() : count_(0) {}
+  virtual ~deferred_ref_counted() {}
+
+public:
+  static const unsigned int NSlots = 256; // per thread
+
+  inline void
+  inc()
+  {
+    if (tl_buffer) {
+      entry &e = tl_buffer->slots[Slot(this)];
+      if (e.obj == this) {
+        if (--e.ndecs == 0)
+          e.obj = nullptr;
+        return;
+      }
+    }
+    count_++;
+  }
+
+  // never drops the last reference right away, so always returns false
+  inline bool
+  dec()
+  {
+    defer(this);
+    return false;
+  }
+
+  // adds n references, and drops one (n may be 0)
+  inline bool
+  transfer(uint32_t n)
+  {
+    if (n == 0)
+      defer(this);
+    else if (n > 1)
+      count_.fetch_add(n - 1);
+    return false;
+  }
+
+  // applies the calling thread's buffered decrements
+  static void flush();
+
+private:
+  struct entry {
+    deferred_ref_counted *obj;
+    uint32_t ndecs;
+  };
+
+  struct buffer {
+    buffer() : slots() {}
+    entry slots[NSlots];
+  };
+
+  static inline unsigned int
+  Slot(const deferred_ref_counted *p)
+  {
+    // objects are at least 16 byte aligned
+    return (uintptr_t(p) >> 4) % NSlots;
+  }
+
+  static void defer(deferred_ref_counted *p);
+  static void apply(const entry &e);
+
+  static buffer &buffer_for_thread();
+  static void make_thread_key();
+  static void thread_exit(void *p);
+
+  static __thread buffer *tl_buffer;
+
+  static pthread_once_t thread_key_once;
+  static pthread_key_t thread_key;
+
+  std::atomic<uint32_t> count_;
+};
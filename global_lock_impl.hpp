@@ -95,6 +95,14 @@ public:
 
   typedef iterator_ iterator;
 
+  // the size of each element's node (w/o the control block
+  // make_shared() allocates along w/ it)
+  static inline size_t
+  bytes_per_elem()
+  {
+    return sizeof(node);
+  }
+
   global_lock_impl() : mutex_(), head_(), tail_() {}
 
   size_t
@@ -0,0 +1,153 @@
+#include <cassert>
+#include <mutex>
+#include <algorithm>
+
+#include "hazard_ptr.hpp"
+#include "macros.hpp"
+
+using namespace std;
+
+const size_t hazard_ptr::RetiredPerSlot;
+const size_t hazard_ptr::MinRetired;
+
+__thread hazard_ptr::record *hazard_ptr::tl_record = nullptr;
+
+pthread_once_t hazard_ptr::thread_key_once = PTHREAD_ONCE_INIT;
+pthread_key_t hazard_ptr::thread_key;
+
+atomic<hazard_ptr::record *> hazard_ptr::records(nullptr);
+atomic<size_t> hazard_ptr::nrecords(0);
+
+spinlock hazard_ptr::orphans_mutex;
+// never destroyed, threads may exit during static destruction
+vector<hazard_ptr::retired_entry> *hazard_ptr::orphans =
+  new vector<hazard_ptr::retired_entry>;
+
+void
+hazard_ptr::make_thread_key()
+{
+  const int ret = pthread_key_create(&thread_key, thread_exit);
+  ASSERT(!ret);
+}
+
+void
+hazard_ptr::acquire_record()
+{
+  pthread_once(&thread_key_once, make_thread_key);
+  record *r;
+  for (r = records.load(memory_order_acquire); r; r = r->next) {
+    bool expected = false;
+    if (!r->in_use.load(memory_order_relaxed) &&
+        r->in_use.compare_exchange_strong(expected, true))
+      break;
+  }
+  if (!r) {
+    r = &cache_aligned_new<aligned_padded_elem<record>>()->elem;
+    r->in_use.store(true, memory_order_relaxed);
+    r->next = records.load(memory_order_relaxed);
+    while (!records.compare_exchange_weak(r->next, r))
+      nop_pause();
+    nrecords++;
+  }
+  tl_record = r;
+  const int ret = pthread_setspecific(thread_key, r);
+  ASSERT(!ret);
+}
+
+void
+hazard_ptr::thread_exit(void *p)
+{
+  record *r = (record *) p;
+  assert(r == tl_record);
+  ASSERT(r->free_slots == ~uint64_t(0));
+  scan(*r);
+  if (!r->retired.empty()) {
+    lock_guard<spinlock> l(orphans_mutex);
+    orphans->insert(orphans->end(), r->retired.begin(), r->retired.end());
+  }
+  r->retired.clear();
+  tl_record = nullptr;
+  r->in_use.store(false, memory_order_release);
+}
+
+unsigned int
+hazard_ptr::acquire_slots(record &r, unsigned int n)
+{
+  const uint64_t mask = (uint64_t(1) << n) - 1;
+  for (unsigned int i = 0; i + n <= NSlots; i++) {
+    if ((r.free_slots & (mask << i)) == (mask << i)) {
+      r.free_slots &= ~(mask << i);
+      return i;
+    }
+  }
+  // too many nested scopes (or live iterators)
+  ASSERT(false);
+  return 0;
+}
+
+void
+hazard_ptr::release_slots(record &r, unsigned int first, unsigned int n)
+{
+  for (unsigned int i = first; i < first + n; i++)
+    r.slots[i].store(nullptr, memory_order_release);
+  r.free_slots |= ((uint64_t(1) << n) - 1) << first;
+}
+
+void
+hazard_ptr::retire(void *p, deleter_t fn)
+{
+  record &r = record_for_thread();
+  r.retired.push_back(retired_entry(p, fn));
+  const size_t threshold =
+    max(MinRetired, RetiredPerSlot * NSlots * nrecords.load(memory_order_relaxed));
+  if (unlikely(r.retired.size() >= threshold))
+    scan(r);
+}
+
+void
+hazard_ptr::barrier()
+{
+  scan(record_for_thread());
+}
+
+void
+hazard_ptr::scan(record &r)
+{
+  {
+    lock_guard<spinlock> l(orphans_mutex);
+    if (!orphans->empty()) {
+      r.retired.insert(r.retired.end(), orphans->begin(), orphans->end());
+      orphans->clear();
+    }
+  }
+  if (r.retired.empty())
+    return;
+
+  // pairs with the (sequentially consistent) store publishing a hazard:
+  // either the reader sees that the ptr was unlinked before we retired it, or
+  // we see its hazard
+  atomic_thread_fence(memory_order_seq_cst);
+
+  // a ptr can be handed from one slot to another while we look (a copied
+  // iterator, a node installed as the list's tail_ and picked up from there
+  // by another thread), but it is always published in the new slot before it
+  // is cleared from the old one. so if a single pass misses both slots, the
+  // new one was published during that pass, and the second pass sees it
+  vector<void *> hazards;
+  for (unsigned int pass = 0; pass < 2; pass++)
+    for (record *rec = records.load(memory_order_acquire); rec; rec = rec->next)
+      for (unsigned int i = 0; i < NSlots; i++)
+        if (void *h = rec->slots[i].load(memory_order_acquire))
+          hazards.push_back(h);
+  sort(hazards.begin(), hazards.end());
+
+  // deleters could retire more objects
+  vector<retired_entry> retired;
+  retired.swap(r.retired);
+  for (auto &e : retired) {
+    if (binary_search(hazards.begin(), hazards.end(), e.first))
+      r.retired.push_back(e);
+    else
+      e.second(e.first);
+  }
+}
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <pthread.h>
+
+#include "macros.hpp"
+#include "spinlock.hpp"
+#include "util.hpp"
+
+/**
+ * Hazard pointer based reclamation (Michael, 2004).
+ *
+ * Each thread owns a record of NSlots hazard slots, in which it publishes
+ * pointers before dereferencing them, and a private list of retired objects.
+ * Once that list grows past a threshold proportional to the total number of
+ * slots, the thread frees every retired object which no slot points to. A
+ * stalled thread thus only keeps the objects in its own slots alive, unlike
+ * an RCU reader which holds up all reclamation.
+ *
+ * Reading a pointer safely is a matter of publishing it, and then checking
+ * that the location it was read from still holds it (see
+ * scoped_hazard_ptrs::load()). This is only sound as long as that location
+ * cannot point to an object which was already retired.
+ */
+class hazard_ptr {
+public:
+  typedef void (*deleter_t)(void *);
+  typedef std::pair<void *, deleter_t> retired_entry;
+
+  static const unsigned int NSlots = 64; // per thread
+
+  template <typename T>
+  static inline void
+  deleter(void *p)
+  {
+    delete (T *) p;
+  }
+
+  struct record {
+    record()
+      : slots(), free_slots(~uint64_t(0)), retired(), in_use(false),
+        next(nullptr) {}
+    record(const record &) = delete;
+    record &operator=(const record &) = delete;
+
+    std::atomic<void *> slots[NSlots];
+
+    // only touched by the owner
+    uint64_t free_slots; // bitmask
+    std::vector<retired_entry> retired;
+
+    std::atomic<bool> in_use;
+    record *next; // records are never deallocated, only recycled
+  };
+
+  static inline record &
+  record_for_thread()
+  {
+    if (unlikely(!tl_record))
+      acquire_record();
+    return *tl_record;
+  }
+
+  // hands out n consecutive free slots of the calling thread's record,
+  // returning the index of the first one
+  static unsigned int acquire_slots(record &r, unsigned int n);
+  static void release_slots(record &r, unsigned int first, unsigned int n);
+
+  static void retire(void *p, deleter_t fn);
+
+  // frees the objects retired by the calling thread, and those left behind
+  // by exited threads, which aren't protected right now. objects retired by
+  // other live threads stay on their lists until those threads scan or exit
+  static void barrier();
+
+private:
+  static void acquire_record();
+  static void make_thread_key();
+  static void thread_exit(void *p);
+  static void scan(record &r);
+
+  // a thread scans once it has retired this many objects per hazard slot
+  // (counting all records), so each scan frees at least half of them
+  static const size_t RetiredPerSlot = 2;
+  static const size_t MinRetired = 64;
+
+  static __thread record *tl_record;
+
+  static pthread_once_t thread_key_once;
+  static pthread_key_t thread_key;
+
+  static std::atomic<record *> records;
+  static std::atomic<size_t> nrecords;
+
+  static spinlock orphans_mutex; // protects orphans
+  static std::vector<retired_entry> *orphans; // from exited threads
+};
+
+// ScopedImpl for lock_free_impl: each scope takes NSlots slots from the
+// thread's record, the first time it protects something (iterators get passed
+// around by value a lot, end() ones never protect anything)
+class scoped_hazard_ptrs {
+public:
+  static const unsigned int NSlots = 3;
+
+  // a node we protect keeps its memory, but whatever its links point to may
+  // be retired once the node itself is removed
+  static const bool ProtectsRemoved = false;
+  static const bool GuardsNodes = true;
+
+  inline scoped_hazard_ptrs() : rec_(nullptr), base_(0) {}
+
+  // copies get their own slots, it's up to the owner to protect() them
+  inline scoped_hazard_ptrs(const scoped_hazard_ptrs &that)
+    : rec_(nullptr), base_(0) {}
+
+  inline ~scoped_hazard_ptrs()
+  {
+    if (rec_)
+      hazard_ptr::release_slots(*rec_, base_, NSlots);
+  }
+
+  // keeps our slots
+  inline scoped_hazard_ptrs &
+  operator=(const scoped_hazard_ptrs &that)
+  {
+    return *this;
+  }
+
+  // publishes p in slot i. p must already be safe to dereference (ie we
+  // allocated it, or it's protected by another slot)
+  inline void
+  protect(unsigned int i, void *p)
+  {
+    if (p || rec_)
+      slot(i).store(p);
+  }
+
+  // loads src into dst, protecting the node in slot i. returns false, w/o
+  // touching dst, if src is marked: then src belongs to a removed node, so
+  // the node it points to may have been retired already, and the caller has
+  // to start over from a node which is still linked
+  template <typename D, typename P>
+  inline bool
+  load(unsigned int i, D &dst, const P &src)
+  {
+    std::atomic<void *> &s = slot(i);
+    typename P::opaque_t raw = src.get_raw();
+    for (;;) {
+      s.store(P::Ptr(raw)); // sequentially consistent store
+      const typename P::opaque_t again = src.get_raw();
+      if (again == raw)
+        break;
+      raw = again;
+    }
+    if (P::IsMarked(raw))
+      return false;
+    dst = D(P::Ptr(raw));
+    return true;
+  }
+
+  template <typename T>
+  inline void
+  release(T *p) const
+  {
+    hazard_ptr::retire(p, hazard_ptr::deleter<T>);
+  }
+
+  static inline void
+  barrier()
+  {
+    hazard_ptr::barrier();
+  }
+
+private:
+  inline std::atomic<void *> &
+  slot(unsigned int i)
+  {
+    if (unlikely(!rec_)) {
+      rec_ = &hazard_ptr::record_for_thread();
+      base_ = hazard_ptr::acquire_slots(*rec_, NSlots);
+    }
+    return rec_->slots[base_ + i];
+  }
+
+  hazard_ptr::record *rec_; // null until we protect something
+  unsigned int base_;
+};
@@ -102,6 +102,12 @@ public:
 
   // begin non-standard API
 
+  static inline size_t
+  bytes_per_elem()
+  {
+    return Impl::bytes_per_elem();
+  }
+
   std::pair<bool, T>
   try_pop_front()
   {
@@ -3,28 +3,76 @@
 #include <cassert>
 #include <memory>
 #include <iterator>
+#include <type_traits>
+#include <utility>
 
 #include "atomic_reference.hpp"
 #include "macros.hpp"
 
 namespace private_ {
 struct nop_scoper {
+  // nodes are kept alive by the references we hold to them
+  static const bool ProtectsRemoved = true;
+  static const bool GuardsNodes = false;
+
+  inline void protect(unsigned int, void *) const {}
+
+  template <typename D, typename P>
+  inline bool
+  load(unsigned int, D &dst, const P &src) const
+  {
+    // src may be a link in the node dst holds the last reference to (cur =
+    // cur->next_), which assigning dst frees. so copy src out first, and
+    // then move it in
+    D tmp(src);
+    dst = std::move(tmp);
+    return true;
+  }
+
   template <typename T>
   inline void release(T *) const {}
+  static inline void barrier() {}
+};
+
+struct heap_alloc {
+  template <typename T>
+  static inline void *
+  allocate()
+  {
+    return ::operator new(sizeof(T));
+  }
+
+  template <typename T>
+  static inline void
+  deallocate(void *p)
+  {
+    ::operator delete(p);
+  }
 };
 }
 
 /**
- * Lock-free singly-linked list implemention, with configurable ref counting
- * and garbage collection policies
+ * Lock-free singly-linked list implemention, with configurable ref counting,
+ * garbage collection, and node allocation policies
  *
  * References returned by this implementation are guaranteed to be valid until
  * the element is removed from the list
+ *
+ * Links are read through ScopedImpl::load(), into one of a few slots per
+ * scope, so that hazard pointer scopes can protect each node before it is
+ * dereferenced. Such scopes don't protect what removed nodes point to
+ * (ProtectsRemoved is false), so traversals which reach a removed node start
+ * over from a live one instead of following it
+ *
+ * Scopes which keep nodes alive by themselves (GuardsNodes, ie rcu regions and
+ * hazard ptrs) are traversed w/ guarded_ptrs, which don't take references, so
+ * that read-only traversals don't write to the nodes they visit
  */
 template <typename T,
           typename RefPtrLockImpl = spinlock,
           typename RefCountImpl = atomic_ref_counted,
-          typename ScopedImpl = private_::nop_scoper>
+          typename ScopedImpl = private_::nop_scoper,
+          typename AllocImpl = private_::heap_alloc>
 class lock_free_impl {
 private:
 
@@ -47,6 +95,21 @@ private:
       assert(next_.get_mark());
     }
 
+    // nodes are freed by whoever drops the last reference (or by the
+    // ScopedImpl's reclaimer), so route both ends through AllocImpl
+    static inline void *
+    operator new(size_t sz)
+    {
+      assert(sz == sizeof(node));
+      return AllocImpl::template allocate<node>();
+    }
+
+    static inline void
+    operator delete(void *p)
+    {
+      AllocImpl::template deallocate<node>(p);
+    }
+
     T value_;
     node_ptr next_;
 
@@ -57,13 +120,62 @@ private:
     }
   };
 
+  // what traversals hold on to
+  typedef typename std::conditional<
+    ScopedImpl::GuardsNodes, guarded_ptr<node>, node_ptr>::type trav_ptr;
+
   node_ptr head_; // head_ points to a sentinel beginning node
   mutable node_ptr tail_; // tail_ is maintained loosely
 
+  // owned() makes a node_ptr out of a guarded_ptr, w/o a reference of its
+  // own to back it. that's only fine if node_ptrs don't count references
+  static_assert(!ScopedImpl::GuardsNodes ||
+                std::is_same<RefCountImpl, nop_ref_counted>::value,
+                "scopes which guard nodes need nop_ref_counted nodes");
+
+  // for storing a traversal ptr into a link
+  static inline const node_ptr &
+  owned(const node_ptr &p)
+  {
+    return p;
+  }
+
+  static inline node_ptr
+  owned(const guarded_ptr<node> &p)
+  {
+    return node_ptr(p.get());
+  }
+
   struct iterator_ : public std::iterator<std::forward_iterator_tag, T> {
-    iterator_() : node_(), scoper_() {}
-    iterator_(const node_ptr &node)
-      : node_(node), scoper_() {}
+    iterator_()
+      : scoper_(), prev_slot_(0), slot_(1), list_(nullptr), prev_(),
+        pp_(nullptr), node_() {}
+    iterator_(const lock_free_impl *list)
+      : scoper_(), prev_slot_(0), slot_(1), list_(list), prev_(),
+        pp_(&list_->head_->next_), node_()
+    {
+      scoper_.load(slot_, node_, *pp_);
+    }
+
+    iterator_(const iterator_ &that)
+      : scoper_(that.scoper_), prev_slot_(0), slot_(1), list_(that.list_),
+        prev_(that.prev_), pp_(that.pp_), node_(that.node_)
+    {
+      scoper_.protect(prev_slot_, prev_.get());
+      scoper_.protect(slot_, node_.get());
+    }
+
+    iterator_ &
+    operator=(const iterator_ &that)
+    {
+      list_ = that.list_;
+      prev_ = that.prev_;
+      pp_ = that.pp_;
+      node_ = that.node_;
+      scoper_.protect(prev_slot_, prev_.get());
+      scoper_.protect(slot_, node_.get());
+      return *this;
+    }
 
     typedef T value_type;
 
@@ -97,7 +209,13 @@ private:
     operator++()
     {
       do {
-        node_ = node_->next_;
+        if (!list_->advance(scoper_, prev_slot_, slot_, prev_, pp_, node_)) {
+          // our node was removed, and we can't tell what follows it anymore,
+          // so start over (elements may be visited twice)
+          prev_ = trav_ptr();
+          pp_ = &list_->head_->next_;
+          scoper_.load(slot_, node_, *pp_);
+        }
       } while (node_ && node_->is_marked());
       return *this;
     }
@@ -110,44 +228,70 @@ private:
       return cur;
     }
 
-    node_ptr node_;
     ScopedImpl scoper_;
+    unsigned int prev_slot_, slot_;
+    const lock_free_impl *list_;
+    trav_ptr prev_; // null for the sentinel
+    node_ptr *pp_; // the link in prev_ node_ was read from
+    trav_ptr node_;
   };
 
 public:
 
   typedef iterator_ iterator;
 
+  // the size of each element's node
+  static inline size_t
+  bytes_per_elem()
+  {
+    return sizeof(node);
+  }
+
   lock_free_impl() : head_(new node), tail_(head_) {}
   ~lock_free_impl()
   {
-    ScopedImpl scoper;
-    // can do this non-thread safe, since we know there are
-    // no other mutators
-    node_ptr cur = head_;
-    while (cur) {
-      if (cur->next_.mark())
-        scoper.release(cur.get());
-      cur = cur->next_;
+    {
+      ScopedImpl scoper;
+      // can do this non-thread safe, since we know there are
+      // no other mutators
+      node_ptr cur = head_;
+      while (cur) {
+        // released nodes may be freed right away
+        node_ptr next = cur->next_;
+        if (cur->next_.mark())
+          scoper.release(cur.get());
+        cur = std::move(next);
+      }
     }
+    // don't leave our nodes to be freed at some later point (which also means
+    // a list must not be destroyed from inside a scope). w/ hazard ptrs, that
+    // only goes for the nodes retired by this thread (or by exited ones),
+    // other threads free theirs when they scan or exit
+    ScopedImpl::barrier();
   }
 
   size_t
   size() const
   {
-    ScopedImpl scoper UNUSED;
+  retry:
+    ScopedImpl scoper;
     assert(!head_->is_marked());
     size_t ret = 0;
-    node_ptr cur = head_->next_;
+    unsigned int prev_slot = 0, slot = 1;
+    trav_ptr prev; // null for the sentinel
+    node_ptr *pp = &head_->next_;
+    trav_ptr cur;
+    scoper.load(slot, cur, *pp);
     while (cur) {
       if (!cur->is_marked()) {
         ret++;
       } else {
         // XXX: reap cur for garbage collection
       }
-      if (!cur->next_ && !cur->is_marked() && tail_ != cur)
-        tail_ = cur;
-      cur = cur->next_;
+      if (!cur->next_ && !cur->is_marked() && tail_.get() != cur.get())
+        set_tail(owned(cur));
+      if (!advance(scoper, prev_slot, slot, prev, pp, cur))
+        goto retry;
     }
     return ret;
   }
@@ -156,20 +300,23 @@ public:
   front()
   {
   retry:
-    ScopedImpl scoper UNUSED;
+    ScopedImpl scoper;
     assert(!head_->is_marked());
-    node_ptr p = head_->next_;
+    trav_ptr p;
+    scoper.load(0, p, head_->next_);
     assert(p);
-    if (p->is_marked())
-      // XXX: reap p for garbage collection
+    if (p->is_marked()) {
+      // whoever removed p may not have gotten to unlink it
+      unlink(scoper, head_->next_, p);
       goto retry;
+    }
     T &ref = p->value_;
     if (p->is_marked())
       // XXX: reap p for garbage collection
       goto retry;
     // we have stability on a reference
-    if (!p->next_ && tail_ != p)
-      tail_ = p;
+    if (!p->next_ && tail_.get() != p.get())
+      set_tail(owned(p));
     return ref;
   }
 
@@ -183,21 +330,31 @@ public:
   back()
   {
   retry:
-    ScopedImpl scoper UNUSED;
+    ScopedImpl scoper;
     assert(!head_->is_marked());
-    node_ptr tail = tail_;
+    unsigned int slot = 0;
+    trav_ptr tail;
+    scoper.load(slot, tail, tail_);
     assert(tail);
+    bool advanced = false;
     while (tail->next_) {
-      tail = tail->next_;
+      slot ^= 1;
+      if (!scoper.load(slot, tail, tail->next_)) {
+        fix_tail_pointer_from_head();
+        goto retry;
+      }
       if (!tail)
         goto retry;
+      advanced = true;
     }
     if (tail->is_marked()) { // hopefully rare
       // XXX: reap p for garbage collection
       fix_tail_pointer_from_head();
       goto retry;
     }
-    tail_ = tail;
+    // see set_tail()
+    if (advanced || ScopedImpl::ProtectsRemoved)
+      set_tail(owned(tail));
     T &ref = tail->value_;
     if (tail->is_marked()) { // see above
       // XXX: reap p for garbage collection
@@ -220,21 +377,22 @@ public:
   retry:
     ScopedImpl scoper;
     assert(!head_->is_marked());
-    node_ptr cur = head_->next_;
+    trav_ptr cur;
+    scoper.load(0, cur, head_->next_);
     assert(cur);
 
-    if (!cur->next_.mark())
-      // was concurrently deleted
+    if (!cur->next_.mark()) {
+      // was concurrently deleted, but maybe not unlinked yet
+      unlink(scoper, head_->next_, cur);
       goto retry;
+    }
 
-    // we don't need to CAS the prev ptr here, because we know that the
-    // sentinel node will never be deleted (that is, the first node of a list
-    // will *always* be the first node)
-    head_->next_ = cur->next_; // semantics of assign() do not copy marked bits
+    // the sentinel node will never be deleted (that is, the first node of a
+    // list will *always* be the first node), but others may unlink cur
+    // for us once it's marked
+    unlink(scoper, head_->next_, cur);
     if (!cur->next_ && tail_ != head_)
       tail_ = head_;
-    assert(cur->is_marked());
-    scoper.release(cur.get());
   }
 
   void
@@ -243,10 +401,16 @@ public:
   retry:
     ScopedImpl scoper;
     assert(!head_->is_marked());
-    node_ptr tail = tail_;
+    unsigned int slot = 0;
+    trav_ptr tail;
+    scoper.load(slot, tail, tail_);
     assert(tail);
     while (tail->next_) {
-      tail = tail->next_;
+      slot ^= 1;
+      if (!scoper.load(slot, tail, tail->next_)) {
+        fix_tail_pointer_from_head();
+        goto retry;
+      }
       if (!tail)
         goto retry;
     }
@@ -255,41 +419,44 @@ public:
       goto retry;
     }
     node_ptr n(new node(val, node_ptr()));
+    // n can be popped (and released) as soon as it's linked
+    scoper.protect(2, n.get());
     if (!tail->next_.compare_exchange_strong(node_ptr(), n)) {
       bool ret = n->next_.mark(); // be pedantic
       if (!ret) assert(false);
       scoper.release(n.get());
       goto retry;
     }
-    tail_ = n;
+    set_tail(n);
   }
 
   inline void
   remove(const T &val)
   {
+  retry:
     ScopedImpl scoper;
-    node_ptr prev = head_;
-    node_ptr p = head_->next_, *pp = &head_->next_;
+    // the slots holding prev and p, the third one is for loading the next p
+    unsigned int prev_slot = 0, slot = 1;
+    trav_ptr prev = head_;
+    trav_ptr p;
+    node_ptr *pp = &head_->next_;
+    scoper.load(slot, p, *pp);
     while (p) {
-      if (p->value_ == val) {
-        // mark removed
-        if (p->next_.mark()) {
-          // try to unlink- ignore success value
-          if (pp->compare_exchange_strong(p, p->next_)) {
-            // successful unlink, report
-            assert(p->is_marked());
-            scoper.release(p.get());
-          }
-          if (!p->next_)
-            tail_ = prev;
-        }
-        // in any case, advance the current ptr, but keep the
-        // prev ptr the same
-        p = p->next_;
-      } else {
-        prev = p;
-        pp = &p->next_;
-        p = p->next_;
+      const unsigned int next_slot = 3 - prev_slot - slot;
+      if (p->value_ == val && p->next_.mark()) {
+        // try to unlink- ignore success value (if a neighbor gets unlinked
+        // at the same time, we fail, and leave p to whoever comes by next)
+        unlink(scoper, *pp, p);
+        if (!p->next_)
+          set_tail(owned(prev));
+        // advance the current ptr, but keep the prev ptr the same. if p
+        // can't be followed, continue from prev
+        if (!scoper.load(next_slot, p, p->next_) &&
+            !scoper.load(next_slot, p, *pp))
+          goto retry;
+        slot = next_slot;
+      } else if (!advance(scoper, prev_slot, slot, prev, pp, p, true)) {
+        goto retry;
       }
     }
   }
@@ -300,35 +467,35 @@ public:
   retry:
     ScopedImpl scoper;
     assert(!head_->is_marked());
-    node_ptr cur = head_->next_;
+    trav_ptr cur;
+    scoper.load(0, cur, head_->next_);
 
     if (unlikely(!cur))
       return std::make_pair(false, T());
 
-    if (!cur->next_.mark())
-      // was concurrently deleted
+    if (!cur->next_.mark()) {
+      // was concurrently deleted, but maybe not unlinked yet
+      unlink(scoper, head_->next_, cur);
       goto retry;
+    }
 
     T t = cur->value_;
-    head_->next_ = cur->next_; // semantics of assign() do not copy marked bits
+    unlink(scoper, head_->next_, cur); // see pop_front()
     if (!cur->next_ && tail_ != head_)
       tail_ = head_;
-    assert(cur->is_marked());
-    scoper.release(cur.get());
     return std::make_pair(true, t);
   }
 
   iterator
   begin()
   {
-    ScopedImpl scoper UNUSED;
-    return iterator_(head_->next_);
+    return iterator_(this);
   }
 
   iterator
   end()
   {
-    return iterator_(node_ptr());
+    return iterator_();
   }
 
 private:
@@ -336,14 +503,94 @@ private:
   void
   fix_tail_pointer_from_head() const
   {
-    node_ptr cur = head_->next_;
-    node_ptr prev = head_;
-    while (cur) {
-      prev = cur;
-      cur = cur->next_;
-    }
+  retry:
+    ScopedImpl scoper;
+    unsigned int prev_slot = 0, slot = 1;
+    trav_ptr prev = head_;
+    node_ptr *pp = &head_->next_;
+    trav_ptr cur;
+    scoper.load(slot, cur, *pp);
+    while (cur)
+      if (!advance(scoper, prev_slot, slot, prev, pp, cur, true))
+        goto retry;
     assert(prev);
-    tail_ = prev;
+    set_tail(owned(prev));
+  }
+
+  // moves cur, which was read from the link *pp in prev, on to the node
+  // after it. prev, cur and the next node take up the scope's three slots.
+  // unless keep_prev is set, prev and pp are only kept track of when the
+  // scope doesn't protect removed nodes (a marked cur can't be followed
+  // then). when they are, a marked cur is unlinked instead of becoming prev
+  // (whoever removed it fails to when a neighbor is unlinked at the same
+  // time, and links of a marked prev can't be changed anymore), and we go on
+  // w/ what prev points to now. returns false if the traversal has to start
+  // over, because prev was removed as well
+  inline bool
+  advance(ScopedImpl &scoper, unsigned int &prev_slot, unsigned int &slot,
+          trav_ptr &prev, node_ptr *&pp, trav_ptr &cur,
+          bool keep_prev = false) const
+  {
+    const unsigned int next_slot = 3 - prev_slot - slot;
+    if (ScopedImpl::ProtectsRemoved && !keep_prev) {
+      scoper.load(next_slot, cur, cur->next_);
+    } else if (cur->is_marked()) {
+      if (!unlink(scoper, *pp, cur) && pp->get_mark())
+        return false;
+      if (!scoper.load(next_slot, cur, *pp))
+        return false;
+      slot = next_slot;
+      return true;
+    } else {
+      // hand cur's reference over to prev
+      prev = std::move(cur);
+      pp = &prev->next_;
+      if (!scoper.load(next_slot, cur, *pp))
+        return false;
+    }
+    prev_slot = slot;
+    slot = next_slot;
+    return true;
+  }
+
+  // unlinks p, which is marked, from the link which pointed to it. anyone
+  // who comes across p may do this, and whoever succeeds releases it.
+  // returns true if that was us
+  inline bool
+  unlink(ScopedImpl &scoper, node_ptr &link, const trav_ptr &p) const
+  {
+    assert(p->is_marked());
+    if (!link.compare_exchange_strong(owned(p), p->next_))
+      return false;
+    untail(owned(p));
+    scoper.release(p.get());
+    return true;
+  }
+
+  // tail_ is only a hint, but when the scope doesn't protect removed nodes, a
+  // thread which reads n from tail_ and then sees tail_ unchanged has to be
+  // able to rely on n not being freed. so a node is taken out of tail_ before
+  // it is released (untail()), and only a node reached through a link (or
+  // allocated by us) is ever stored into tail_, never one which was read from
+  // tail_ itself. the storing thread then checks, while n is still protected,
+  // that it wasn't removed in the meantime. whoever picked n up from tail_
+  // before that has published its hazard before we drop ours, which
+  // hazard_ptr::scan() accounts for
+  inline void
+  set_tail(const node_ptr &n) const
+  {
+    tail_ = n;
+    if (!ScopedImpl::ProtectsRemoved && n->is_marked())
+      untail(n);
+  }
+
+  inline void
+  untail(const node_ptr &n) const
+  {
+    if (ScopedImpl::ProtectsRemoved)
+      return;
+    while (tail_ == n)
+      tail_.compare_exchange_strong(n, head_);
   }
 };
 
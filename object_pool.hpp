@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstddef>
+#include <atomic>
+#include <new>
+
+#include "asm.hpp"
+#include "macros.hpp"
+
+/**
+ * A pool of fixed size objects, whose memory is recycled instead of being
+ * given back to the allocator.
+ *
+ * Objects may be freed by any thread (ie the RCU gc thread), and are handed
+ * back to allocating threads in batches: each thread collects the objects it
+ * frees privately, and publishes them on a shared stack every BatchSize
+ * objects. A thread which runs out of objects to allocate first reuses what
+ * it freed itself, and otherwise takes the whole shared stack at once. Since
+ * the shared stack is only ever pushed onto or emptied, it is not subject to
+ * ABA.
+ */
+template <size_t Size>
+class object_pool {
+  struct free_obj {
+    free_obj *next;
+  };
+
+  static_assert(Size >= sizeof(free_obj), "objects too small to pool");
+
+  static const size_t BatchSize = 64;
+
+  struct thread_cache {
+    thread_cache()
+      : alloc_head(nullptr), freed_head(nullptr),
+        freed_tail(nullptr), nfreed(0) {}
+
+    // don't strand our objects when the thread exits
+    ~thread_cache()
+    {
+      if (alloc_head) {
+        free_obj *tail = alloc_head;
+        while (tail->next)
+          tail = tail->next;
+        push_shared(alloc_head, tail);
+      }
+      if (freed_head)
+        push_shared(freed_head, freed_tail);
+    }
+
+    free_obj *alloc_head;
+    free_obj *freed_head;
+    free_obj *freed_tail;
+    size_t nfreed;
+  };
+
+public:
+  static inline void *
+  allocate()
+  {
+    thread_cache &c = tl_cache;
+    free_obj *o = c.alloc_head;
+    if (unlikely(!o)) {
+      if (c.freed_head) {
+        o = c.freed_head;
+        c.freed_head = c.freed_tail = nullptr;
+        c.nfreed = 0;
+      } else {
+        o = shared.exchange(nullptr, std::memory_order_acquire);
+        if (!o)
+          return ::operator new(Size);
+      }
+    }
+    c.alloc_head = o->next;
+    return o;
+  }
+
+  static inline void
+  deallocate(void *p)
+  {
+    thread_cache &c = tl_cache;
+    free_obj *o = (free_obj *) p;
+    o->next = c.freed_head;
+    if (!c.freed_head)
+      c.freed_tail = o;
+    c.freed_head = o;
+    if (unlikely(++c.nfreed == BatchSize)) {
+      push_shared(c.freed_head, c.freed_tail);
+      c.freed_head = c.freed_tail = nullptr;
+      c.nfreed = 0;
+    }
+  }
+
+private:
+  static inline void
+  push_shared(free_obj *head, free_obj *tail)
+  {
+    tail->next = shared.load(std::memory_order_relaxed);
+    while (!shared.compare_exchange_weak(tail->next, head,
+                                         std::memory_order_release,
+                                         std::memory_order_relaxed))
+      nop_pause();
+  }
+
+  static std::atomic<free_obj *> shared;
+  static thread_local thread_cache tl_cache;
+};
+
+template <size_t Size>
+std::atomic<typename object_pool<Size>::free_obj *>
+  object_pool<Size>::shared(nullptr);
+
+template <size_t Size>
+thread_local typename object_pool<Size>::thread_cache
+  object_pool<Size>::tl_cache;
+
+// allocation policy which recycles objects through an object_pool, shared by
+// all types of the same size
+struct object_pool_alloc {
+  template <typename T>
+  static inline void *
+  allocate()
+  {
+    return object_pool<sizeof(T)>::allocate();
+  }
+
+  template <typename T>
+  static inline void
+  deallocate(void *p)
+  {
+    object_pool<sizeof(T)>::deallocate(p);
+  }
+};
@@ -125,6 +125,14 @@ public:
 
   typedef iterator_ iterator;
 
+  // the size of each element's node (w/o the control block
+  // make_shared() allocates along w/ it)
+  static inline size_t
+  bytes_per_elem()
+  {
+    return sizeof(node);
+  }
+
   per_node_lock_impl() : head_(new node), tail_(head_) {}
 
   size_t
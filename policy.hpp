@@ -7,12 +7,29 @@
 
 #include "rcu.hpp"
 #include "atomic_reference.hpp"
+#include "object_pool.hpp"
+#include "hazard_ptr.hpp"
+#include "biased_ref_counted.hpp"
+#include "deferred_ref_counted.hpp"
 
 template <typename T>
 struct ll_policy {
   typedef global_lock_impl<T> global_lock;
   typedef per_node_lock_impl<T> per_node_lock;
   typedef lock_free_impl<T> lock_free;
+  typedef lock_free_impl<T, split_ref_count> lock_free_split;
+  typedef lock_free_impl<T, tagged_ref_count> lock_free_tagged;
+  typedef lock_free_impl<T, striped_lock> lock_free_striped;
+  typedef lock_free_impl<T, spinlock, biased_ref_counted> lock_free_biased;
+  typedef lock_free_impl<T, spinlock, deferred_ref_counted> lock_free_deferred;
   typedef lock_free_impl<T, nop_lock, nop_ref_counted, scoped_rcu_region>
           lock_free_rcu;
+  typedef lock_free_impl<T, nop_lock, nop_ref_counted, scoped_rcu_region,
+                         object_pool_alloc>
+          lock_free_rcu_pool;
+  typedef lock_free_impl<T, nop_lock, nop_ref_counted, scoped_hazard_ptrs>
+          lock_free_hp;
+  typedef lock_free_impl<T, nop_lock, nop_ref_counted,
+                         basic_scoped_rcu_region<inline_rcu_domain>>
+          lock_free_ebr;
 };
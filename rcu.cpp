@@ -1,111 +1,872 @@
 #include <cassert>
-#include <ctime>
-#include <cstring>
+#include <cstdlib>
 #include <mutex>
+#include <chrono>
+#include <algorithm>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "rcu.hpp"
 #include "macros.hpp"
-#include "timer.hpp"
 
 using namespace std;
 
-atomic<rcu::epoch_t> rcu::global_epoch(0);
-atomic<bool> rcu::gc_thread_started(false);
+atomic<uint64_t> rcu_domain::ids_in_use(0);
+atomic<uint64_t> rcu_domain::ngenerations(0);
 
-__thread unsigned int rcu::tl_crit_section_depth = 0;
-__thread rcu::epoch_t rcu::tl_current_epoch = 0;
+spinlock rcu_domain::chunk_pool_mutex;
+rcu_domain::delete_chunk *rcu_domain::chunk_pool = nullptr;
+size_t rcu_domain::nchunks_pooled = 0;
 
-spinlock rcu::rcu_mutex;
-aligned_padded_elem<rcu::sync> rcu::syncs[NSyncs];
+__thread rcu_domain::thread_state rcu_domain::tl_state[MaxDomains];
+
+rcu_domain::rcu_domain(reclaim_mode mode)
+  : id(acquire_id()),
+    generation(++ngenerations),
+    mode(mode),
+    global_epoch(0),
+    domain_mutex(),
+    policy(),
+    max_pending_objs(policy.max_pending_objs),
+    max_pending_bytes(policy.max_pending_bytes),
+    max_deferred_objs(policy.max_deferred_objs),
+    max_deferred_bytes(policy.max_deferred_bytes),
+    pending_objs(0),
+    pending_bytes(0),
+    deferred_objs(0),
+    deferred_bytes(0),
+    backpressure_events(0),
+    stats_mutex(),
+    stats_(),
+    gc_requested(false),
+    gc_parked(true), // nothing deferred yet
+    gc_thread_started(false),
+    gc_thread(),
+    gc_stop(false),
+    completed_epochs(0),
+    live_syncs(),
+    orphans(),
+    orphan_epochs(),
+    new_syncs(nullptr),
+    free_syncs(nullptr),
+    exited_syncs(nullptr),
+    reclaimers(),
+    reclaims_running(0),
+    reclaimed_objs(0),
+    reclaim_stop(false)
+{
+  const int ret = pthread_key_create(&thread_key, thread_exit);
+  ASSERT(!ret);
+}
+
+rcu_domain::~rcu_domain()
+{
+  if (gc_thread_started.load(memory_order_acquire)) {
+    {
+      lock_guard<mutex> l(gc_wait_mutex);
+      gc_stop = true;
+    }
+    gc_wait_cv.notify_one();
+    gc_thread.join();
+  }
+  barrier();
+  stop_reclaimers();
+  pthread_key_delete(thread_key);
+
+  // the syncs of threads which never exited are still around, but those
+  // threads will never look at them again: a domain which gets our id next
+  // has a different generation. w/ inline reclamation, they may still hold
+  // deletes of their own. syncs on exited_syncs are on one of these lists as
+  // well
+  for (sync *s = new_syncs.exchange(nullptr); s; s = s->next)
+    live_syncs.push_back(s);
+  for (sync *s = free_syncs; s; s = s->next)
+    live_syncs.push_back(s);
+  orphans[0].run_and_clear();
+  orphans[1].run_and_clear();
+  for (auto s : live_syncs) {
+    assert(!IsActive(s->local_epoch.load(memory_order_relaxed)));
+    s->local_queues[0].run_and_clear();
+    s->local_queues[1].run_and_clear();
+    cache_aligned_delete((aligned_padded_elem<sync> *) s);
+  }
+  release_id(id);
+}
+
+unsigned int
+rcu_domain::acquire_id()
+{
+  static_assert(MaxDomains <= 64, "ids_in_use has a bit per id");
+  uint64_t v = ids_in_use.load();
+  for (;;) {
+    unsigned int i = 0;
+    while (i < MaxDomains && (v & (uint64_t(1) << i)))
+      i++;
+    // too many domains at once
+    ASSERT(i < MaxDomains);
+    if (ids_in_use.compare_exchange_weak(v, v | (uint64_t(1) << i)))
+      return i;
+  }
+}
 
 void
-rcu::init()
+rcu_domain::release_id(unsigned int id)
+{
+  ids_in_use.fetch_and(~(uint64_t(1) << id));
+}
+
+void
+rcu_domain::init()
 {
   // double-check-locking (DCL) pattern
   if (likely(gc_thread_started.load(memory_order_acquire)))
     return;
-  lock_guard<spinlock> l(rcu_mutex);
+  lock_guard<spinlock> l(domain_mutex);
   if (gc_thread_started.load(memory_order_acquire))
     return;
-  // start gc thread as daemon thread
-  thread t(gc_loop);
-  t.detach(); // daemonize
-  gc_thread_started.store(memory_order_release);
+  gc_thread = thread(&rcu_domain::gc_loop, this);
+  gc_thread_started.store(true, memory_order_release);
+}
+
+rcu_domain::delete_chunk *
+rcu_domain::alloc_chunk()
+{
+  delete_chunk *c = nullptr;
+  {
+    lock_guard<spinlock> l(chunk_pool_mutex);
+    if ((c = chunk_pool)) {
+      chunk_pool = c->next;
+      nchunks_pooled--;
+    }
+  }
+  if (!c)
+    c = new delete_chunk;
+  c->next = nullptr;
+  c->nentries = 0;
+  c->nbytes = 0;
+  return c;
+}
+
+void
+rcu_domain::recycle_chunks(delete_chunk *head, delete_chunk *tail, size_t nchunks)
+{
+  {
+    lock_guard<spinlock> l(chunk_pool_mutex);
+    if (nchunks_pooled + nchunks <= MaxPooledChunks) {
+      tail->next = chunk_pool;
+      chunk_pool = head;
+      nchunks_pooled += nchunks;
+      return;
+    }
+  }
+  // the pool is full (ie after a burst), so give the memory back
+  while (head) {
+    delete_chunk *c = head;
+    head = c->next;
+    delete c;
+  }
+}
+
+size_t
+rcu_domain::delete_queue::run_and_clear(size_t *nbytes)
+{
+  size_t nrun = 0, nchunks = 0, total_bytes = rcu_heads_nbytes_;
+  for (delete_chunk *c = head_; c; c = c->next) {
+    for (size_t i = 0; i < c->nentries; i++) {
+      const delete_entry &e = c->entries[i];
+      if (e.second == inline_call)
+        i += reinterpret_cast<call_invoker_t>(e.first)(&c->entries[i + 1]);
+      else
+        e.second(e.first);
+      nrun++;
+    }
+    total_bytes += c->nbytes;
+    nchunks++;
+  }
+  if (head_)
+    recycle_chunks(head_, tail_, nchunks);
+  head_ = tail_ = nullptr;
+
+  for (rcu_head *h = rcu_heads_; h;) {
+    // func may well free h
+    rcu_head *next = h->next;
+    h->func(h);
+    h = next;
+    nrun++;
+  }
+  rcu_heads_ = rcu_heads_tail_ = nullptr;
+  rcu_heads_nbytes_ = 0;
+  size_ = 0;
+
+  if (nbytes)
+    *nbytes = total_bytes;
+  return nrun;
 }
 
 void
-rcu::region_begin()
+rcu_domain::inline_call(void *)
 {
-  if (!tl_crit_section_depth++) {
+  ASSERT(false);
+}
+
+size_t
+rcu_domain::run_deletes(delete_queue &q)
+{
+  size_t nbytes;
+  const size_t n = q.run_and_clear(&nbytes);
+  if (n) {
+    deferred_objs.fetch_sub(n, memory_order_relaxed);
+    deferred_bytes.fetch_sub(nbytes, memory_order_relaxed);
+  }
+  return n;
+}
+
+void
+rcu_domain::thread_exit(void *p)
+{
+  sync *s = (sync *) p;
+  assert(s == tl_state[s->domain->id].s);
+  s->domain->unregister_thread();
+}
+
+void
+rcu_domain::register_thread()
+{
+  thread_state &t = state_for_thread();
+  if (t.s)
+    return;
+  sync *s;
+  {
+    lock_guard<spinlock> l(domain_mutex);
+    if ((s = free_syncs))
+      free_syncs = s->next;
+  }
+  if (!s) {
+    s = &cache_aligned_new<aligned_padded_elem<sync>>()->elem;
+    s->domain = this;
+  }
+  // a recycled sync was emptied out and dropped from live_syncs after its
+  // previous owner unregistered
+  assert(!IsActive(s->local_epoch.load(memory_order_relaxed)));
+  assert(s->local_queues[0].empty() && s->local_queues[1].empty());
+  s->ticks = 0;
+
+  // hand the sync to the gc thread. if it misses this one on its current
+  // pass, the fence makes sure our first region_begin() observes the epoch
+  // the gc thread bumped to before it took the new syncs
+  s->next = new_syncs.load(memory_order_relaxed);
+  while (!new_syncs.compare_exchange_weak(s->next, s))
+    nop_pause();
+  atomic_thread_fence(memory_order_seq_cst);
+  t.s = s;
+  const int ret = pthread_setspecific(thread_key, s);
+  ASSERT(!ret);
+}
+
+void
+rcu_domain::unregister_thread()
+{
+  thread_state &t = state_for_thread();
+  sync *s = t.s;
+  if (!s)
+    return;
+  ASSERT(!t.crit_section_depth);
+  if (mode == ReclaimInline)
+    reclaim_limbo(*s);
+  if (s->unflushed_objs)
+    flush_pending(*s);
+  s->throttled = false;
+  pthread_setspecific(thread_key, nullptr);
+  t.s = nullptr;
+
+  // whatever is left is run by the next grace periods (w/ inline
+  // reclamation, by whoever advances the epoch). we can't wait for one to
+  // drop us from the scans: it may be stuck on a reader which is waiting
+  // for us to exit
+  s->exited_next = exited_syncs.load(memory_order_relaxed);
+  while (!exited_syncs.compare_exchange_weak(s->exited_next, s))
+    nop_pause();
+
+  // if nobody is at it, get the sync recycled right away
+  unique_lock<mutex> l(gp_mutex, try_to_lock);
+  if (l.owns_lock())
+    update_live_syncs();
+}
+
+void
+rcu_domain::region_begin()
+{
+  if (!state_for_thread().crit_section_depth++) {
     sync &s = sync_for_thread();
-    s.local_critical_mutex.lock();
-    tl_current_epoch = global_epoch.load(memory_order_acquire);
+    // publish the epoch we are reading under. the fence orders the
+    // publication before any loads done inside the region, pairing with the
+    // fence in gc_loop() after the global epoch is bumped: either the gc
+    // thread sees us as active, or we observe every unlink which happened
+    // before the bump
+    const epoch_t e = global_epoch.load(memory_order_relaxed);
+    s.local_epoch.store(MakeActive(e), memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
   }
 }
 
 void
-rcu::region_end()
+rcu_domain::region_end()
 {
-  assert(tl_crit_section_depth);
-  if (!--tl_crit_section_depth) {
+  thread_state &t = state_for_thread();
+  assert(t.crit_section_depth);
+  if (!--t.crit_section_depth) {
     sync &s = sync_for_thread();
-    s.local_critical_mutex.unlock();
+    s.local_epoch.store(0, memory_order_release);
+    if (unlikely(s.throttled))
+      backpressure(s);
+    else if (mode == ReclaimInline && unlikely(++s.ticks >= InlineTicks))
+      tick(s);
   }
 }
 
 void
-rcu::free_with_fn(void *p, deleter_t fn)
+rcu_domain::set_gc_policy(const gc_policy &p)
 {
-  init(); // make sure RCU GC loop is running
-  assert(tl_crit_section_depth);
-  sync &s = sync_for_thread();
-  s.local_queues[tl_current_epoch % 2].push_back(move(delete_entry(p, fn)));
+  ASSERT(p.min_epoch_us <= p.epoch_us);
+  lock_guard<spinlock> l(domain_mutex);
+  policy = p;
+  max_pending_objs.store(p.max_pending_objs, memory_order_relaxed);
+  max_pending_bytes.store(p.max_pending_bytes, memory_order_relaxed);
+  max_deferred_objs.store(p.max_deferred_objs, memory_order_relaxed);
+  max_deferred_bytes.store(p.max_deferred_bytes, memory_order_relaxed);
 }
 
-static const uint64_t rcu_epoch_us = 50 * 1000; /* 50 ms */
+rcu_domain::gc_policy
+rcu_domain::get_gc_policy()
+{
+  lock_guard<spinlock> l(domain_mutex);
+  return policy;
+}
 
 void
-rcu::gc_loop()
+rcu_domain::request_gc()
 {
-  struct timespec t;
-  memset(&t, 0, sizeof(t));
-  timer loop_timer;
-  // runs as daemon thread
+  if (gc_requested.load(memory_order_relaxed) || gc_requested.exchange(true))
+    return;
+  lock_guard<mutex> l(gc_wait_mutex);
+  gc_wait_cv.notify_one();
+}
+
+void
+rcu_domain::flush_pending(sync &s)
+{
+  deferred_objs.fetch_add(s.unflushed_objs, memory_order_relaxed);
+  deferred_bytes.fetch_add(s.unflushed_bytes, memory_order_relaxed);
+  if (unlikely(over_deferred_caps()))
+    // can't wait for anyone from inside our region, so hold off until the end
+    // of it
+    s.throttled = true;
+
+  if (mode == ReclaimByGcThread) {
+    const size_t objs =
+      pending_objs.fetch_add(s.unflushed_objs, memory_order_relaxed) +
+      s.unflushed_objs;
+    const size_t bytes =
+      pending_bytes.fetch_add(s.unflushed_bytes, memory_order_relaxed) +
+      s.unflushed_bytes;
+    const size_t max_objs = max_pending_objs.load(memory_order_relaxed);
+    const size_t max_bytes = max_pending_bytes.load(memory_order_relaxed);
+    if ((max_objs && objs >= max_objs) || (max_bytes && bytes >= max_bytes))
+      request_gc();
+  }
+  s.unflushed_objs = 0;
+  s.unflushed_bytes = 0;
+}
+
+void
+rcu_domain::backpressure(sync &s)
+{
+  typedef chrono::steady_clock clock;
+  s.throttled = false;
+  if (!over_deferred_caps())
+    return;
+  backpressure_events.fetch_add(1, memory_order_relaxed);
+  const clock::time_point deadline =
+    clock::now() + chrono::microseconds(get_gc_policy().backpressure_us);
+  // we might be the one reader holding things up in some other domain, so
+  // only ever wait for a bounded time
   for (;;) {
-    const uint64_t last_loop_usec = loop_timer.lap();
-    const uint64_t delay_time_usec = rcu_epoch_us;
-    if (last_loop_usec < delay_time_usec) {
-      t.tv_nsec = (delay_time_usec - last_loop_usec) * 1000;
-      nanosleep(&t, NULL);
+    if (mode == ReclaimInline)
+      tick(s);
+    else
+      request_gc();
+    if (!over_deferred_caps() || clock::now() >= deadline)
+      return;
+    this_thread::sleep_for(chrono::microseconds(50));
+  }
+}
+
+rcu_domain::delete_queue &
+rcu_domain::defer_queue(sync &s)
+{
+  assert(state_for_thread().crit_section_depth);
+  // tag the entry w/ the global epoch as of *now* (after the caller has
+  // unlinked p), not the epoch our region started in: a reader which started
+  // after our region did could still hold p, but only if it started before
+  // the global epoch moved past the value loaded here
+  const epoch_t e = global_epoch.load();
+  delete_queue &q = s.local_queues[e % 2];
+
+  if (mode == ReclaimInline) {
+    if (!q.empty() && s.limbo_epochs[e % 2] != e) {
+      // left over from e - 2 or before, which no reader can hold anymore
+      delete_queue elems;
+      elems.splice(q);
+      run_deletes(elems);
+    }
+    s.limbo_epochs[e % 2] = e;
+  } else {
+    init(); // make sure RCU GC loop is running
+    // the gc thread parked after a grace period which claimed every delete
+    // tagged w/ an epoch before the one it moved to, but it can only have
+    // seen e if it had set gc_parked before (see gc_loop()). if q isn't
+    // empty, whoever pushed the first entry into it woke it up already
+    if (q.empty() && unlikely(gc_parked.load(memory_order_relaxed)))
+      request_gc();
+  }
+  return q;
+}
+
+void
+rcu_domain::free_with_fn(void *p, deleter_t fn, size_t nbytes)
+{
+  sync &s = sync_for_thread();
+  defer_queue(s).push(delete_entry(p, fn), nbytes);
+  deferred(s, nbytes);
+}
+
+void
+rcu_domain::call(rcu_head *h, void (*func)(rcu_head *), size_t nbytes)
+{
+  sync &s = sync_for_thread();
+  h->func = func;
+  defer_queue(s).push(h, nbytes);
+  deferred(s, nbytes);
+}
+
+void
+rcu_domain::deferred(sync &s, size_t nbytes)
+{
+  s.unflushed_bytes += nbytes;
+  if (unlikely(++s.unflushed_objs >= FlushObjs ||
+               s.unflushed_bytes >= FlushBytes))
+    flush_pending(s);
+  if (mode == ReclaimInline && unlikely(++s.ticks >= InlineTicks))
+    tick(s);
+}
+
+size_t
+rcu_domain::grace_period()
+{
+  typedef chrono::steady_clock clock;
+  const clock::time_point start = clock::now();
+
+  // requests made after this point (ie by anyone who observes the new epoch)
+  // are for the next grace period
+  gc_requested.store(false, memory_order_relaxed);
+
+  // increment global epoch
+  const epoch_t cleaning_epoch = global_epoch.load(memory_order_acquire);
+  global_epoch.store(cleaning_epoch + 1); // sequentially consistent store
+  atomic_thread_fence(memory_order_seq_cst);
+
+  const size_t retired = pending_objs.exchange(0, memory_order_relaxed);
+  pending_bytes.store(0, memory_order_relaxed);
+
+  // pick up newly registered threads (must happen after the bump, see
+  // register_thread()), and drop the ones which unregistered
+  update_live_syncs();
+
+  // deal the claimed queues out round robin, starting w/ our own share
+  const gc_policy p = get_gc_policy();
+  const unsigned int nworkers = p.nreclaimers;
+  start_reclaimers(nworkers);
+  unsigned int nclaimed = 0;
+
+  delete_queue elems;
+  vector<size_t> claimed;
+  claimed.reserve(live_syncs.size());
+
+  // now wait for each thread to finish any outstanding critical sections
+  // which started at or before cleaning_epoch. we only read the published
+  // epochs, readers never block on us
+  for (auto ps : live_syncs) {
+    sync &s = *ps;
+    wait_for_reader(s, cleaning_epoch, p.stall_us);
+
+    // any thread still in a critical section now *must* observe the new
+    // global_epoch when it tags its deletes, so we can now claim its
+    // deleted pointers from cleaning_epoch
+    delete_queue &q = s.local_queues[cleaning_epoch % 2];
+    claimed.push_back(q.size());
+    if (!q.empty()) {
+      const unsigned int part = nclaimed++ % (nworkers + 1);
+      (part ? reclaimers[part - 1]->pending : elems).splice(q);
     }
+  }
+
+  // unregistered threads deferred theirs before they left, so they are as
+  // good as any other's
+  delete_queue &orphaned = orphans[cleaning_epoch % 2];
+  if (!orphaned.empty()) {
+    const unsigned int part = nclaimed++ % (nworkers + 1);
+    (part ? reclaimers[part - 1]->pending : elems).splice(orphaned);
+  }
+
+  const size_t nrun =
+    run_reclaimers(elems, nclaimed > 1 ? min(nclaimed - 1, nworkers) : 0);
+
+  const uint64_t us =
+    chrono::duration_cast<chrono::microseconds>(clock::now() - start).count();
+  {
+    lock_guard<spinlock> l(stats_mutex);
+    stats_.grace_periods++;
+    stats_.gp_us.add(us);
+    stats_.deletes_per_gp.add(nrun);
+    stats_.claimed_per_thread.swap(claimed);
+  }
+
+  completed_epochs = cleaning_epoch + 1;
+  gp_done_cv.notify_all();
+  return retired + nrun;
+}
+
+void
+rcu_domain::wait_for_reader(const sync &s, epoch_t e, uint64_t stall_us)
+{
+  typedef chrono::steady_clock clock;
+  epoch_t v = s.local_epoch.load(memory_order_acquire);
+  if (!IsActive(v) || EpochOf(v) > e)
+    return;
+
+  // only look at the clock every so often while spinning
+  static const unsigned int ClockPeriod = 1024;
+  const clock::time_point start = clock::now();
+  bool stalled = false;
+  for (unsigned int n = 1;; n++) {
+    nop_pause();
+    v = s.local_epoch.load(memory_order_acquire);
+    if (!IsActive(v) || EpochOf(v) > e)
+      break;
+    if (n % ClockPeriod)
+      continue;
+    const uint64_t us = chrono::duration_cast<chrono::microseconds>(
+        clock::now() - start).count();
+    if (us < stall_us)
+      continue;
+    lock_guard<spinlock> l(stats_mutex);
+    if (!stalled) {
+      stats_.stalls++;
+      stalled = true;
+    }
+    stats_.stalled_reader_us = us;
+    stats_.stalled_reader_epoch = EpochOf(v);
+  }
+
+  const uint64_t us = chrono::duration_cast<chrono::microseconds>(
+      clock::now() - start).count();
+  lock_guard<spinlock> l(stats_mutex);
+  stats_.reader_wait_us.add(us);
+  if (stalled) {
+    stats_.stalled_reader_us = 0;
+    stats_.stalled_reader_epoch = 0;
+  }
+}
+
+rcu_domain::stats
+rcu_domain::get_stats()
+{
+  stats ret;
+  {
+    lock_guard<spinlock> l(stats_mutex);
+    ret = stats_;
+  }
+  ret.global_epoch = global_epoch.load(memory_order_relaxed);
+  ret.deferred_objs = deferred_objs.load(memory_order_relaxed);
+  ret.deferred_bytes = deferred_bytes.load(memory_order_relaxed);
+  ret.backpressure_events = backpressure_events.load(memory_order_relaxed);
+  return ret;
+}
 
-    // increment global epoch
-    const epoch_t cleaning_epoch = global_epoch.load(memory_order_acquire);
-    global_epoch.store(cleaning_epoch + 1); // sequentially consistent store
+void
+rcu_domain::start_reclaimers(unsigned int n)
+{
+  // reclaimers are never stopped before the domain goes away, a smaller
+  // nreclaimers just leaves the extra ones idle
+  while (reclaimers.size() < n) {
+    reclaimer *r = new reclaimer;
+    r->thread = thread(&rcu_domain::reclaim_loop, this, r);
+    reclaimers.push_back(r);
+  }
+}
 
+void
+rcu_domain::reclaim_loop(reclaimer *r)
+{
+  for (;;) {
     delete_queue elems;
+    {
+      unique_lock<mutex> l(reclaim_mutex);
+      reclaim_cv.wait(l,
+          [this, r] { return reclaim_stop || !r->work.empty(); });
+      if (r->work.empty())
+        return;
+      elems.splice(r->work);
+    }
+    const size_t n = run_deletes(elems);
+    lock_guard<mutex> l(reclaim_mutex);
+    reclaimed_objs += n;
+    if (!--reclaims_running)
+      reclaim_done_cv.notify_all();
+  }
+}
 
-    // now wait for each thread to finish any outstanding critical sections
-    // from the previous epoch, and advance it forward to the global epoch
-    for (size_t i = 0; i < NSyncs; i++) {
-      sync &s = syncs[i].elem;
+size_t
+rcu_domain::run_reclaimers(delete_queue &elems, unsigned int n)
+{
+  if (n) {
+    // the reclaimers only ever wait on reclaim_mutex, not gp_mutex, so
+    // holding on to the latter is fine
+    lock_guard<mutex> l(reclaim_mutex);
+    for (unsigned int i = 0; i < n; i++)
+      reclaimers[i]->work.splice(reclaimers[i]->pending);
+    reclaims_running += n;
+    reclaimed_objs = 0;
+    reclaim_cv.notify_all();
+  }
+  size_t nrun = run_deletes(elems);
+  if (n) {
+    unique_lock<mutex> l(reclaim_mutex);
+    reclaim_done_cv.wait(l, [this] { return !reclaims_running; });
+    nrun += reclaimed_objs;
+  }
+  return nrun;
+}
+
+void
+rcu_domain::stop_reclaimers()
+{
+  {
+    lock_guard<mutex> l(reclaim_mutex);
+    reclaim_stop = true;
+  }
+  reclaim_cv.notify_all();
+  for (auto r : reclaimers) {
+    r->thread.join();
+    delete r;
+  }
+  reclaimers.clear();
+}
 
-      {
-        lock_guard<spinlock> l(s.local_critical_mutex);
+void
+rcu_domain::adopt_orphans(sync &s)
+{
+  if (mode == ReclaimByGcThread) {
+    // neither queue has been claimed yet, and the tags line up
+    orphans[0].splice(s.local_queues[0]);
+    orphans[1].splice(s.local_queues[1]);
+    return;
+  }
+  // the lists for an index are a multiple of 2 epochs apart, so the older
+  // one is at least 2 epochs behind the global epoch by now, and can go
+  // right away
+  for (unsigned int i = 0; i < 2; i++) {
+    delete_queue &q = s.local_queues[i];
+    if (q.empty())
+      continue;
+    if (!orphans[i].empty() && orphan_epochs[i] != s.limbo_epochs[i]) {
+      delete_queue elems;
+      if (orphan_epochs[i] < s.limbo_epochs[i]) {
+        elems.splice(orphans[i]);
+      } else {
+        elems.splice(q);
+        run_deletes(elems);
+        continue;
       }
+      run_deletes(elems);
+    }
+    orphans[i].splice(q);
+    orphan_epochs[i] = s.limbo_epochs[i];
+  }
+}
+
+void
+rcu_domain::update_live_syncs()
+{
+  // an exited sync was pushed onto new_syncs before, so if it isn't in
+  // live_syncs yet, taking new_syncs after exited_syncs finds it
+  sync *exited = exited_syncs.exchange(nullptr);
+  for (sync *p = new_syncs.exchange(nullptr); p; p = p->next)
+    live_syncs.push_back(p);
+  if (!exited)
+    return;
+  for (sync *s = exited; s; s = s->exited_next) {
+    auto it = find(live_syncs.begin(), live_syncs.end(), s);
+    ASSERT(it != live_syncs.end());
+    *it = live_syncs.back();
+    live_syncs.pop_back();
+    adopt_orphans(*s);
+  }
+
+  lock_guard<spinlock> l(domain_mutex);
+  while (exited) {
+    sync *s = exited;
+    exited = s->exited_next;
+    s->next = free_syncs;
+    free_syncs = s;
+  }
+}
+
+void
+rcu_domain::tick(sync &s)
+{
+  s.ticks = 0;
+  {
+    // if someone else is at it, they'll do
+    unique_lock<mutex> l(gp_mutex, try_to_lock);
+    if (l.owns_lock())
+      advance_epoch(false);
+  }
+  reclaim_limbo(s);
+}
 
-      // now the next time the thread enters a critical section, it
-      // *must* get the new global_epoch, so we can now claim its
-      // deleted pointers from global_epoch - 1
-      delete_queue &q = s.local_queues[cleaning_epoch % 2];
-      elems.insert(elems.end(), q.begin(), q.end());
-      q.clear();
+void
+rcu_domain::reclaim_limbo(sync &s)
+{
+  // pairs w/ the store in advance_epoch(): the readers it waited out are done
+  // w/ what they read
+  const epoch_t e = global_epoch.load(memory_order_acquire);
+  for (unsigned int i = 0; i < 2; i++) {
+    if (!s.local_queues[i].empty() && s.limbo_epochs[i] + 2 <= e) {
+      delete_queue elems;
+      elems.splice(s.local_queues[i]);
+      run_deletes(elems);
     }
+  }
+}
 
-    for (delete_queue::iterator it = elems.begin();
-         it != elems.end(); ++it)
-      it->second(it->first);
-    elems.clear();
+bool
+rcu_domain::advance_epoch(bool wait)
+{
+  const epoch_t e = global_epoch.load(memory_order_acquire);
+  // a thread which registers, or enters a region, after we look at it
+  // observes e (see region_begin() and register_thread())
+  atomic_thread_fence(memory_order_seq_cst);
+  update_live_syncs();
+
+  for (auto s : live_syncs) {
+    for (;;) {
+      const epoch_t v = s->local_epoch.load(memory_order_acquire);
+      if (!IsActive(v) || EpochOf(v) >= e)
+        break;
+      if (!wait)
+        return false;
+      nop_pause();
+    }
+  }
+  global_epoch.store(e + 1); // sequentially consistent store
+
+  // unregistered threads won't run their remaining deletes themselves
+  delete_queue elems;
+  for (unsigned int j = 0; j < 2; j++)
+    if (!orphans[j].empty() && orphan_epochs[j] + 2 <= e + 1)
+      elems.splice(orphans[j]);
+  run_deletes(elems);
+  return true;
+}
+
+void
+rcu_domain::wait_for_epoch(epoch_t e, bool expedite)
+{
+  // we'd be waiting for ourselves
+  ASSERT(!state_for_thread().crit_section_depth);
+  unique_lock<mutex> l(gp_mutex);
+  if (mode == ReclaimInline) {
+    // readers which published e or before are gone once every reader has
+    // been seen in e + 1
+    while (global_epoch.load(memory_order_relaxed) < e + 2)
+      advance_epoch(true);
+    return;
+  }
+  while (completed_epochs <= e) {
+    if (expedite) {
+      grace_period();
+    } else {
+      init();
+      request_gc();
+      gp_done_cv.wait(l);
+    }
+  }
+}
+
+void
+rcu_domain::synchronize()
+{
+  // every reader which is around right now published an epoch <= e
+  wait_for_epoch(global_epoch.load(), false);
+}
+
+void
+rcu_domain::synchronize_expedited()
+{
+  wait_for_epoch(global_epoch.load(), true);
+}
+
+void
+rcu_domain::barrier()
+{
+  // every delete deferred before now was tagged w/ an epoch <= e
+  wait_for_epoch(global_epoch.load(), true);
+  thread_state &t = state_for_thread();
+  if (mode == ReclaimInline && t.s)
+    reclaim_limbo(*t.s);
+}
+
+void
+rcu_domain::gc_loop()
+{
+  typedef chrono::steady_clock clock;
+  clock::time_point last_epoch = clock::now();
+  bool park = true;
+  for (;;) {
+    const gc_policy p = get_gc_policy();
+    {
+      unique_lock<mutex> l(gc_wait_mutex);
+      auto woken =
+        [this] { return gc_stop || gc_requested.load(memory_order_relaxed); };
+      if (park)
+        gc_wait_cv.wait(l, woken);
+      else
+        gc_wait_cv.wait_until(
+            l, last_epoch + chrono::microseconds(p.epoch_us), woken);
+      if (gc_stop)
+        return;
+    }
+    // even when asked to hurry, give readers some time to get out of the way
+    this_thread::sleep_until(last_epoch + chrono::microseconds(p.min_epoch_us));
+    last_epoch = clock::now();
+
+    size_t nwork;
+    {
+      lock_guard<mutex> l(gp_mutex);
+      nwork = grace_period();
+    }
+
+    if (nwork) {
+      park = false;
+      gc_parked.store(false, memory_order_relaxed);
+    } else if (!gc_parked.load(memory_order_relaxed)) {
+      // nothing to do. writers which see the epoch the next grace period
+      // moves to also see this, and wake us up as needed. that grace period
+      // claims everything deferred before, so if it finds nothing, we park
+      gc_parked.store(true, memory_order_relaxed);
+    } else {
+      park = true;
+    }
   }
 }
@@ -5,17 +5,50 @@
 #include <thread>
 #include <functional>
 #include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+#include <utility>
+#include <new>
+#include <pthread.h>
 
 #include "spinlock.hpp"
 #include "util.hpp"
 
-class rcu {
+// embed one in an object to defer a call on it w/o any allocation at all,
+// see rcu_domain::call(). func typically static_casts the head back to the
+// object which derives from it
+struct rcu_head {
+  rcu_head *next;
+  void (*func)(rcu_head *);
+};
+
+/**
+ * An RCU domain has its own global epoch, registered threads, and gc thread,
+ * so a reader which lingers in a region of one domain never holds up
+ * reclamation in another. Regions of different domains may be nested.
+ *
+ * A domain created w/ ReclaimInline has no gc thread. It does classic three
+ * epoch EBR instead: every so often, a thread leaving a region or deferring a
+ * delete tries to advance the global epoch (which only succeeds once every
+ * reader has entered its region in the current epoch), and then runs its
+ * own deletes from two epochs back. Deletes deferred during epoch e are
+ * kept on one of two lists per thread until the epoch reaches e + 2, and
+ * the list is reused for e + 2 after running them.
+ *
+ * Most code uses the default domain, through the static rcu interface below.
+ * Domains are identified by a small id, which indexes each thread's state
+ * for the domain. Ids are recycled once their domain is destroyed, so at
+ * most MaxDomains domains can exist at once. Each domain also gets a
+ * generation which is never reused, so that a thread can tell its state for
+ * a destroyed domain apart from that for a new one w/ the same id.
+ */
+class rcu_domain {
 public:
   typedef uint64_t epoch_t;
 
   typedef void (*deleter_t)(void *);
   typedef std::pair<void *, deleter_t> delete_entry;
-  typedef std::vector<delete_entry> delete_queue;
 
   template <typename T>
   static inline void
@@ -31,85 +64,914 @@ public:
     delete [] (T *) p;
   }
 
+  // a callable deferred by call() is stored in the entries right after a
+  // header entry, whose second is inline_call() and whose first is the
+  // invoker below: it runs and destroys the callable, and returns the number
+  // of entries it took up. callables which don't fit in MaxInlineCallBytes
+  // are heap allocated instead
+  typedef size_t (*call_invoker_t)(void *);
+
+  static const size_t MaxInlineCallBytes = 3 * sizeof(delete_entry);
+
+  template <typename F>
+  struct inline_callable {
+    static const bool value =
+      sizeof(F) <= MaxInlineCallBytes &&
+      std::alignment_of<F>::value <= std::alignment_of<delete_entry>::value;
+    static const size_t NSlots =
+      (sizeof(F) + sizeof(delete_entry) - 1) / sizeof(delete_entry);
+  };
+
+  template <typename F>
+  static size_t
+  invoke_inline(void *storage)
+  {
+    F &f = *(F *) storage;
+    f();
+    f.~F();
+    return inline_callable<F>::NSlots;
+  }
+
+  template <typename F>
+  static void
+  invoke_heap(void *p)
+  {
+    F *f = (F *) p;
+    (*f)();
+    delete f;
+  }
+
+  // deferred deletes are kept in fixed size chunks, so that deferring one is
+  // O(1) w/o ever reallocating, and whole queues can be handed over by
+  // relinking them. chunks are recycled through a global pool. each chunk
+  // also sums up the sizes of its entries, for the deferred byte count
+  struct delete_chunk {
+    static const size_t NEntries =
+      (4096 - sizeof(delete_chunk *) - 2 * sizeof(size_t)) /
+      sizeof(delete_entry);
+    delete_chunk *next;
+    size_t nentries;
+    size_t nbytes;
+    delete_entry entries[NEntries];
+  };
+
+  // rcu_heads are linked into a list of their own, next to the chunks
+  class delete_queue {
+  public:
+    delete_queue()
+      : head_(nullptr), tail_(nullptr), rcu_heads_(nullptr),
+        rcu_heads_tail_(nullptr), rcu_heads_nbytes_(0), size_(0) {}
+    delete_queue(const delete_queue &) = delete;
+    delete_queue &operator=(const delete_queue &) = delete;
+
+    inline bool
+    empty() const
+    {
+      return !head_ && !rcu_heads_;
+    }
+
+    // the number of entries (not slots) queued
+    inline size_t
+    size() const
+    {
+      return size_;
+    }
+
+    inline void
+    push(const delete_entry &e, size_t nbytes)
+    {
+      reserve(1);
+      head_->entries[head_->nentries++] = e;
+      head_->nbytes += nbytes;
+      size_++;
+    }
+
+    // F must be an inline_callable
+    template <typename F>
+    inline void
+    push_call(F &&f, size_t nbytes)
+    {
+      typedef typename std::decay<F>::type C;
+      const size_t n = 1 + inline_callable<C>::NSlots;
+      reserve(n);
+      delete_entry *e = &head_->entries[head_->nentries];
+      e->first = reinterpret_cast<void *>(&invoke_inline<C>);
+      e->second = inline_call;
+      new (e + 1) C(std::forward<F>(f));
+      head_->nentries += n;
+      head_->nbytes += nbytes;
+      size_++;
+    }
+
+    inline void
+    push(rcu_head *h, size_t nbytes)
+    {
+      h->next = nullptr;
+      if (rcu_heads_tail_)
+        rcu_heads_tail_->next = h;
+      else
+        rcu_heads_ = h;
+      rcu_heads_tail_ = h;
+      rcu_heads_nbytes_ += nbytes;
+      size_++;
+    }
+
+    // moves all of that's entries into this queue
+    inline void
+    splice(delete_queue &that)
+    {
+      if (that.head_) {
+        that.tail_->next = head_;
+        if (!head_)
+          tail_ = that.tail_;
+        head_ = that.head_;
+        that.head_ = that.tail_ = nullptr;
+      }
+      if (that.rcu_heads_) {
+        that.rcu_heads_tail_->next = rcu_heads_;
+        if (!rcu_heads_)
+          rcu_heads_tail_ = that.rcu_heads_tail_;
+        rcu_heads_ = that.rcu_heads_;
+        rcu_heads_nbytes_ += that.rcu_heads_nbytes_;
+        that.rcu_heads_ = that.rcu_heads_tail_ = nullptr;
+        that.rcu_heads_nbytes_ = 0;
+      }
+      size_ += that.size_;
+      that.size_ = 0;
+    }
+
+    // runs every entry and recycles the chunks. returns the number run, and
+    // if nbytes is given, stores their total size there
+    size_t run_and_clear(size_t *nbytes = nullptr);
+
+  private:
+    // makes room for n consecutive entries in the head chunk
+    inline void
+    reserve(size_t n)
+    {
+      if (unlikely(!head_ || head_->nentries + n > delete_chunk::NEntries)) {
+        delete_chunk *c = alloc_chunk();
+        c->next = head_;
+        if (!head_)
+          tail_ = c;
+        head_ = c;
+      }
+    }
+
+    delete_chunk *head_;
+    delete_chunk *tail_;
+    rcu_head *rcu_heads_;
+    rcu_head *rcu_heads_tail_;
+    size_t rcu_heads_nbytes_;
+    size_t size_;
+  };
+
   // all threads interact w/ the RCU subsystem via
   // a sync struct
   struct sync {
-    sync() = default;
+    sync()
+      : local_epoch(0), local_queues(), limbo_epochs(), ticks(0),
+        unflushed_objs(0), unflushed_bytes(0), throttled(false),
+        domain(nullptr), next(nullptr), exited_next(nullptr) {}
     sync(const sync &) = delete;
     sync &operator=(const sync &) = delete;
+
+    // published reader state: 0 when the owning thread is outside of an
+    // RCU region, MakeActive(e) when it entered its outermost region while
+    // global_epoch was e. written only by the owner, read by the gc thread
+    std::atomic<epoch_t> local_epoch;
+
     delete_queue local_queues[2];
-    spinlock local_critical_mutex;
+
+    // w/ inline reclamation, the epoch the deletes in each of local_queues
+    // were deferred in, and the number of region exits and deferred deletes
+    // since the owner last tried to advance the epoch (only touched by the
+    // owner)
+    epoch_t limbo_epochs[2];
+    unsigned int ticks;
+
+    // deferred deletes not yet accounted for in pending_objs/pending_bytes
+    // and deferred_objs/deferred_bytes, and whether the last flush found the
+    // domain over its caps (only touched by the owner)
+    size_t unflushed_objs;
+    size_t unflushed_bytes;
+    bool throttled;
+
+    rcu_domain *domain;
+
+    // syncs are only deallocated along w/ their domain, and recycled
+    // otherwise. next links a sync into either new_syncs or free_syncs
+    sync *next;
+
+    // links a sync into exited_syncs. separate from next, since the owner
+    // may unregister before a grace period took the sync off new_syncs
+    sync *exited_next;
+  };
+
+  static const unsigned int MaxDomains = 32;
+
+  enum reclaim_mode {
+    ReclaimByGcThread,
+    ReclaimInline,
   };
 
-  static void region_begin();
-  static void region_end();
+  explicit rcu_domain(reclaim_mode mode = ReclaimByGcThread);
+
+  // a domain may only be destroyed once no thread uses it anymore. deletes
+  // which are still deferred are run
+  ~rcu_domain();
 
-  static void free_with_fn(void *p, deleter_t fn);
+  rcu_domain(const rcu_domain &) = delete;
+  rcu_domain &operator=(const rcu_domain &) = delete;
+
+  // never destroyed, since threads may be using it while static destructors
+  // run at exit
+  static inline rcu_domain &
+  default_domain()
+  {
+    static rcu_domain *const d = cache_aligned_new<rcu_domain>();
+    return *d;
+  }
+
+  // registration happens automatically on first use of the domain by a
+  // thread, and deregistration when that thread exits. threads which want
+  // to do either eagerly may call these explicitly. an unregistering thread
+  // leaves the deletes it deferred to the domain, and never blocks on grace
+  // periods. its state is reused once the next grace period (or epoch
+  // advance) dropped it from the scans
+  void register_thread();
+  void unregister_thread();
+
+  void region_begin();
+  void region_end();
+
+  // nbytes is only used to decide when to advance the epoch early, and to
+  // enforce the caps on deferred bytes
+  void free_with_fn(void *p, deleter_t fn, size_t nbytes = 0);
 
   template <typename T>
-  static inline void
+  inline void
   free(T *p)
   {
-    free_with_fn(p, deleter<T>);
+    free_with_fn(p, deleter<T>, sizeof(T));
   }
 
   template <typename T>
-  static inline void
+  inline void
   free_array(T *p)
   {
     free_with_fn(p, deleter_array<T>);
   }
 
+  // defers a call of f(), once every reader which may still see what the
+  // caller unlinked is done. f is moved into the queue itself, unless it is
+  // larger than MaxInlineCallBytes
+  template <typename F>
+  inline void
+  call(F &&f, size_t nbytes = 0)
+  {
+    typedef typename std::decay<F>::type C;
+    sync &s = sync_for_thread();
+    delete_queue &q = defer_queue(s);
+    if (inline_callable<C>::value)
+      q.push_call(std::forward<F>(f), nbytes);
+    else
+      q.push(delete_entry(new C(std::forward<F>(f)), invoke_heap<C>), nbytes);
+    deferred(s, nbytes);
+  }
+
+  // defers a call of func(h)
+  void call(rcu_head *h, void (*func)(rcu_head *), size_t nbytes = 0);
+
+  // wait until every reader which is currently inside a region of this
+  // domain has left it. synchronize() waits for the gc thread to get there
+  // (asking it to hurry), synchronize_expedited() advances the epoch from
+  // the calling thread. neither may be called from inside a region of this
+  // domain
+  void synchronize();
+  void synchronize_expedited();
+
+  // like synchronize_expedited(), but also guarantees that every delete
+  // deferred before the call has run. w/ inline reclamation, that only holds
+  // for the calling thread's deletes (and those of unregistered threads):
+  // other threads run theirs the next time they pass through the domain
+  void barrier();
+
+  // controls how often the gc thread advances the global epoch (ignored w/
+  // inline reclamation). while deletes trickle in, it advances every
+  // epoch_us. once an epoch passes w/o any deletes, it parks until the next
+  // one is deferred, and then advances right away. once the deletes
+  // deferred during the current epoch exceed max_pending_objs or
+  // max_pending_bytes (0 disables either), the epoch is advanced right away
+  // too. either way, never sooner than min_epoch_us after the previous one
+  //
+  // max_deferred_objs and max_deferred_bytes (0 disables either) cap the
+  // deletes which are deferred but haven't run yet, across all epochs, so
+  // that a reader stuck in a region can't make them pile up w/o bound. a
+  // writer which finds the domain over a cap is throttled when it leaves its
+  // region: it hurries the gc thread (w/ inline reclamation, it advances
+  // the epoch itself), and waits for the deferred deletes to drop below the
+  // caps, for at most backpressure_us
+  //
+  // nreclaimers extra threads help the gc thread run the deletes claimed by
+  // each grace period, so that freeing keeps up w/ writers on many cores.
+  // the claimed queues of the registered threads are dealt out among them
+  // whole. 0 leaves it all to the thread which runs the grace period
+  //
+  // a reader which holds up a grace period for longer than stall_us is
+  // counted as stalled in the stats below
+  struct gc_policy {
+    gc_policy()
+      : min_epoch_us(1000), epoch_us(50 * 1000),
+        max_pending_objs(1 << 18), max_pending_bytes(64 << 20),
+        max_deferred_objs(1 << 22), max_deferred_bytes(size_t(1) << 30),
+        backpressure_us(5000), nreclaimers(0), stall_us(1000 * 1000) {}
+    uint64_t min_epoch_us;
+    uint64_t epoch_us;
+    size_t max_pending_objs;
+    size_t max_pending_bytes;
+    size_t max_deferred_objs;
+    size_t max_deferred_bytes;
+    uint64_t backpressure_us;
+    unsigned int nreclaimers;
+    uint64_t stall_us;
+  };
+
+  void set_gc_policy(const gc_policy &p);
+  gc_policy get_gc_policy();
+
+  // the number of times a writer was throttled by the caps above
+  inline uint64_t
+  backpressure_count() const
+  {
+    return backpressure_events.load(std::memory_order_relaxed);
+  }
+
+  // buckets[0] counts 0s, and buckets[i] the values v w/ 2^(i - 1) <= v <
+  // 2^i (the last bucket also counts everything larger)
+  struct histogram {
+    static const unsigned int NBuckets = 32;
+    histogram() : buckets(), count(0), sum(0), max(0) {}
+
+    inline void
+    add(uint64_t v)
+    {
+      const unsigned int i = v ? 64 - __builtin_clzll(v) : 0;
+      buckets[i < NBuckets ? i : NBuckets - 1]++;
+      count++;
+      sum += v;
+      if (v > max)
+        max = v;
+    }
+
+    uint64_t buckets[NBuckets];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+  };
+
+  // what the gc thread has been up to since the domain was created. w/
+  // inline reclamation, only global_epoch and the fields after it are kept
+  // track of. taking a snapshot never waits for a grace period to finish,
+  // so a stall can be looked into while it lasts
+  struct stats {
+    stats()
+      : grace_periods(0), gp_us(), reader_wait_us(), deletes_per_gp(),
+        stalls(0), stalled_reader_us(0), stalled_reader_epoch(0),
+        claimed_per_thread(), global_epoch(0), deferred_objs(0),
+        deferred_bytes(0), backpressure_events(0) {}
+
+    uint64_t grace_periods;
+    histogram gp_us;
+    // only counts the readers which were still in a region that started
+    // before the grace period did
+    histogram reader_wait_us;
+    histogram deletes_per_gp;
+
+    // the number of readers which held up a grace period for longer than
+    // stall_us, and when the gc thread is waiting on such a reader right
+    // now, how long it has been waiting, and the epoch the reader started
+    // its region in (0 otherwise)
+    uint64_t stalls;
+    uint64_t stalled_reader_us;
+    epoch_t stalled_reader_epoch;
+
+    // the deletes the last grace period claimed from each registered
+    // thread, ie how many each had pending for that epoch
+    std::vector<size_t> claimed_per_thread;
+
+    epoch_t global_epoch;
+    int64_t deferred_objs;
+    int64_t deferred_bytes;
+    uint64_t backpressure_events;
+  };
+
+  stats get_stats();
+
 private:
-  static void init();
+  void init();
+
+  void gc_loop();
+
+  // threads account their deferred deletes in batches, to keep writes to
+  // the shared counters off the common path
+  static const size_t FlushObjs = 64;
+  static const size_t FlushBytes = 64 << 10;
+
+  void flush_pending(sync &s);
+  void request_gc();
+
+  // deferring goes: pick the queue to add to w/ defer_queue() (from inside
+  // a region), push, and account for it w/ deferred()
+  delete_queue &defer_queue(sync &s);
+  void deferred(sync &s, size_t nbytes);
+
+  // marks the header entry of an inline callable, never actually called
+  static void inline_call(void *);
+
+  inline bool
+  over_deferred_caps() const
+  {
+    const int64_t max_objs = max_deferred_objs.load(std::memory_order_relaxed);
+    const int64_t max_bytes =
+      max_deferred_bytes.load(std::memory_order_relaxed);
+    return (max_objs &&
+            deferred_objs.load(std::memory_order_relaxed) >= max_objs) ||
+           (max_bytes &&
+            deferred_bytes.load(std::memory_order_relaxed) >= max_bytes);
+  }
+
+  // throttles a writer which left its region while over the caps
+  void backpressure(sync &s);
+
+  // runs the deletes in q, and takes them off the deferred counts. returns
+  // the number run
+  size_t run_deletes(delete_queue &q);
+
+  // the chunk pool is shared by all domains, and keeps at most
+  // MaxPooledChunks around
+  static const size_t MaxPooledChunks = 1024;
+
+  static delete_chunk *alloc_chunk();
+  static void recycle_chunks(delete_chunk *head, delete_chunk *tail,
+                             size_t nchunks);
+
+  // advances the global epoch, waits out the readers of the previous one,
+  // and runs the deletes they deferred. returns the number of deletes
+  // deferred or run, so the gc thread can tell when it is idle. requires
+  // gp_mutex
+  size_t grace_period();
+  void wait_for_epoch(epoch_t e, bool expedite);
+
+  // waits until s is outside of any region which started in e or before,
+  // and accounts for the time it took in stats_
+  void wait_for_reader(const sync &s, epoch_t e, uint64_t stall_us);
+
+  // inline reclamation: threads try to advance the epoch every InlineTicks
+  // region exits or deferred deletes
+  static const unsigned int InlineTicks = 64;
+
+  void tick(sync &s);
+
+  // runs the deletes s deferred two or more epochs ago
+  void reclaim_limbo(sync &s);
+
+  // moves the global epoch from e to e + 1, provided every reader is
+  // outside of any region or in one which started in e. when some isn't,
+  // returns false, or spins until it is if wait is set. requires gp_mutex
+  bool advance_epoch(bool wait);
+
+  // a reclaimer thread runs whatever grace periods put into its work queue.
+  // grace periods deal claimed queues into pending while they scan (under
+  // gp_mutex), and then hand them over and wait for the reclaimers to finish,
+  // so that the deletes still have all run once the grace period completes
+  struct reclaimer {
+    reclaimer() : pending(), work(), thread() {}
+    delete_queue pending;
+    delete_queue work; // protected by reclaim_mutex
+    std::thread thread;
+  };
 
-  static void gc_loop();
+  void reclaim_loop(reclaimer *r);
 
-  static inline sync&
+  // makes sure at least n reclaimers are running. requires gp_mutex
+  void start_reclaimers(unsigned int n);
+
+  // hands the pending queues of the first n reclaimers over, runs elems,
+  // and waits for the reclaimers to finish. returns the number of deletes
+  // run. requires gp_mutex
+  size_t run_reclaimers(delete_queue &elems, unsigned int n);
+
+  void stop_reclaimers();
+
+  // takes over the deletes still queued in the sync of an unregistered
+  // thread, so that the sync can be reused. requires gp_mutex
+  void adopt_orphans(sync &s);
+
+  // picks up the syncs on new_syncs and exited_syncs, drops the latter from
+  // live_syncs, adopts their deletes and recycles them. requires gp_mutex
+  void update_live_syncs();
+
+  static inline epoch_t
+  MakeActive(epoch_t e)
+  {
+    return (e << 1) | 0x1;
+  }
+
+  static inline bool
+  IsActive(epoch_t v)
+  {
+    return v & 0x1;
+  }
+
+  static inline epoch_t
+  EpochOf(epoch_t v)
+  {
+    return v >> 1;
+  }
+
+  struct thread_state;
+
+  // the calling thread's state for this domain. anything left over from a
+  // destroyed domain which had our id is dropped: its syncs were freed along
+  // w/ it, and its thread key deleted
+  inline thread_state &
+  state_for_thread()
+  {
+    thread_state &t = tl_state[id];
+    if (unlikely(t.generation != generation)) {
+      t.crit_section_depth = 0;
+      t.s = nullptr;
+      t.generation = generation;
+    }
+    return t;
+  }
+
+  // each thread owns its sync struct exclusively, since the published
+  // local_epoch cannot be shared between readers
+  inline sync &
   sync_for_thread()
   {
-    std::thread::id this_id = std::this_thread::get_id();
-    const size_t h = std::hash<std::thread::id>()(this_id);
-    return syncs[h % NSyncs].elem;
+    thread_state &t = state_for_thread();
+    if (unlikely(!t.s))
+      register_thread();
+    return *t.s;
+  }
+
+  static unsigned int acquire_id();
+  static void release_id(unsigned int id);
+
+  static void thread_exit(void *p);
+
+  const unsigned int id;
+  const uint64_t generation;
+  const reclaim_mode mode;
+  pthread_key_t thread_key; // unregisters threads on exit
+
+  std::atomic<epoch_t> global_epoch;
+
+  spinlock domain_mutex; // protects init(), free_syncs, and policy
+
+  gc_policy policy;
+  std::atomic<size_t> max_pending_objs; // mirror policy for writers
+  std::atomic<size_t> max_pending_bytes;
+  std::atomic<size_t> max_deferred_objs;
+  std::atomic<size_t> max_deferred_bytes;
+
+  // deletes deferred since the global epoch was last advanced
+  std::atomic<size_t> pending_objs;
+  std::atomic<size_t> pending_bytes;
+
+  // deletes deferred but not run yet. writers add theirs in batches, which
+  // may be run before they are added, so these can dip below 0 for a while
+  std::atomic<int64_t> deferred_objs;
+  std::atomic<int64_t> deferred_bytes;
+
+  std::atomic<uint64_t> backpressure_events;
+
+  // only the histograms, the stall info and claimed_per_thread are kept up
+  // to date, the rest is filled in by get_stats()
+  spinlock stats_mutex;
+  stats stats_;
+
+  // set when the gc thread should advance the epoch ahead of schedule
+  std::atomic<bool> gc_requested;
+
+  // set by the gc thread before the last grace period it runs ahead of
+  // parking. a writer which defers into an empty queue while it is set
+  // wakes the gc thread up
+  std::atomic<bool> gc_parked;
+
+  std::atomic<bool> gc_thread_started; // init() is idempotent
+  std::thread gc_thread;
+
+  std::mutex gc_wait_mutex; // protects gc_stop
+  std::condition_variable gc_wait_cv;
+  bool gc_stop;
+
+  // serializes grace periods, which may be run by the gc thread or by
+  // expedited waiters. protects the fields below
+  std::mutex gp_mutex;
+  std::condition_variable gp_done_cv;
+  epoch_t completed_epochs; // all deletes tagged < this have run
+  std::vector<sync *> live_syncs;
+
+  // the deletes left behind by unregistered threads. like the local_queues
+  // of a sync, entries tagged w/ epoch e go into orphans[e % 2]. w/ inline
+  // reclamation, orphan_epochs[i] is the newest epoch in orphans[i]
+  delete_queue orphans[2];
+  epoch_t orphan_epochs[2];
+
+  // syncs registered since the last grace period. live_syncs holds the
+  // rest, so grace periods only ever scan those
+  std::atomic<sync *> new_syncs;
+  sync *free_syncs;
+
+  // syncs of threads which unregistered since the last grace period. they
+  // stay in live_syncs until then, since a grace period may be scanning
+  // them right now
+  std::atomic<sync *> exited_syncs;
+
+  std::vector<reclaimer *> reclaimers; // protected by gp_mutex
+
+  std::mutex reclaim_mutex; // protects the fields below
+  std::condition_variable reclaim_cv; // reclaimers wait for work on it
+  std::condition_variable reclaim_done_cv;
+  unsigned int reclaims_running;
+  size_t reclaimed_objs;
+  bool reclaim_stop;
+
+  static std::atomic<uint64_t> ids_in_use; // bit i is set while i is taken
+  static std::atomic<uint64_t> ngenerations;
+
+  static spinlock chunk_pool_mutex; // protects the fields below
+  static delete_chunk *chunk_pool;
+  static size_t nchunks_pooled;
+
+  // per-thread state for each domain
+  struct thread_state {
+    unsigned int crit_section_depth; // allows recursive RCU regions
+    sync *s;
+    uint64_t generation; // of the domain the above is for, 0 if none
+  };
+  static __thread thread_state tl_state[MaxDomains];
+};
+
+// the interface to the default domain
+class rcu {
+public:
+  typedef rcu_domain::epoch_t epoch_t;
+  typedef rcu_domain::deleter_t deleter_t;
+  typedef rcu_domain::gc_policy gc_policy;
+
+  static inline rcu_domain &
+  domain()
+  {
+    return rcu_domain::default_domain();
   }
 
-  static spinlock rcu_mutex; // protects init()
+  static inline void
+  register_thread()
+  {
+    domain().register_thread();
+  }
 
-  static std::atomic<epoch_t> global_epoch;
+  static inline void
+  unregister_thread()
+  {
+    domain().unregister_thread();
+  }
 
-  static std::atomic<bool> gc_thread_started; // init() is idempotent
+  static inline void
+  region_begin()
+  {
+    domain().region_begin();
+  }
 
-  // allows recursive RCU regions
-  static __thread unsigned int tl_crit_section_depth;
-  static __thread epoch_t tl_current_epoch;
+  static inline void
+  region_end()
+  {
+    domain().region_end();
+  }
 
-  static const size_t NSyncs = 1024;
-  static aligned_padded_elem<sync> syncs[NSyncs];
+  static inline void
+  free_with_fn(void *p, deleter_t fn, size_t nbytes = 0)
+  {
+    domain().free_with_fn(p, fn, nbytes);
+  }
+
+  template <typename T>
+  static inline void
+  free(T *p)
+  {
+    domain().free(p);
+  }
+
+  template <typename T>
+  static inline void
+  free_array(T *p)
+  {
+    domain().free_array(p);
+  }
+
+  template <typename F>
+  static inline void
+  call(F &&f, size_t nbytes = 0)
+  {
+    domain().call(std::forward<F>(f), nbytes);
+  }
+
+  static inline void
+  call(rcu_head *h, void (*func)(rcu_head *), size_t nbytes = 0)
+  {
+    domain().call(h, func, nbytes);
+  }
+
+  static inline void
+  synchronize()
+  {
+    domain().synchronize();
+  }
+
+  static inline void
+  synchronize_expedited()
+  {
+    domain().synchronize_expedited();
+  }
+
+  static inline void
+  barrier()
+  {
+    domain().barrier();
+  }
+
+  static inline void
+  set_gc_policy(const gc_policy &p)
+  {
+    domain().set_gc_policy(p);
+  }
+
+  static inline gc_policy
+  get_gc_policy()
+  {
+    return domain().get_gc_policy();
+  }
+
+  static inline uint64_t
+  backpressure_count()
+  {
+    return domain().backpressure_count();
+  }
+
+  static inline rcu_domain::stats
+  get_stats()
+  {
+    return domain().get_stats();
+  }
+};
+
+// Domain parameters for basic_scoped_rcu_region: a type whose get() returns
+// the domain to use
+
+struct default_rcu_domain {
+  static inline rcu_domain &
+  get()
+  {
+    return rcu_domain::default_domain();
+  }
+};
+
+// a separate (never destroyed) domain for each Tag type
+template <typename Tag>
+struct tagged_rcu_domain {
+  static inline rcu_domain &
+  get()
+  {
+    static rcu_domain *const d = cache_aligned_new<rcu_domain>();
+    return *d;
+  }
+};
+
+// a (never destroyed) domain which reclaims inline, w/o a gc thread
+struct inline_rcu_domain {
+  static inline rcu_domain &
+  get()
+  {
+    static rcu_domain *const d =
+      cache_aligned_new<rcu_domain>(rcu_domain::ReclaimInline);
+    return *d;
+  }
+};
+
+/**
+ * A pointer to an object which readers access from inside regions of
+ * Domain, while writers replace it. Owns the object it points to: replaced
+ * objects (and the last one, on destruction) are freed through the domain,
+ * once no reader can still hold them.
+ *
+ * Readers load it w/ rcu_dereference(), which only orders their reads of
+ * the object after the load. Writers publish a fully constructed object w/
+ * rcu_assign() (which leaves the old one to the caller) or
+ * exchange_and_retire(). Writers must not race each other through
+ * rcu_assign(), exchange_and_retire() is safe to use concurrently
+ */
+template <typename T, typename Domain = default_rcu_domain>
+class rcu_ptr {
+public:
+  rcu_ptr() : ptr_(nullptr) {}
+  explicit rcu_ptr(T *p) : ptr_(p) {}
+
+  // readers may still be around
+  ~rcu_ptr()
+  {
+    exchange_and_retire(nullptr);
+  }
+
+  rcu_ptr(const rcu_ptr &) = delete;
+  rcu_ptr &operator=(const rcu_ptr &) = delete;
+
+  // only valid until the caller's region ends
+  inline T *
+  rcu_dereference() const
+  {
+    return ptr_.load(std::memory_order_consume);
+  }
+
+  // publishes p, and returns the old object, which the caller has to free
+  // (ie through the domain)
+  inline T *
+  rcu_assign(T *p)
+  {
+    T *const old = ptr_.load(std::memory_order_relaxed);
+    ptr_.store(p, std::memory_order_release);
+    return old;
+  }
+
+  // publishes p, and frees the old object once readers are done w/ it
+  inline void
+  exchange_and_retire(T *p)
+  {
+    T *const old = ptr_.exchange(p, std::memory_order_acq_rel);
+    if (!old)
+      return;
+    // deferring only works from inside a region
+    rcu_domain &d = Domain::get();
+    d.region_begin();
+    d.free(old);
+    d.region_end();
+  }
+
+private:
+  std::atomic<T *> ptr_;
 };
 
-class scoped_rcu_region {
+template <typename Domain>
+class basic_scoped_rcu_region {
 public:
-  inline scoped_rcu_region()
+  // nothing removed inside the region is freed before it ends
+  static const bool ProtectsRemoved = true;
+  static const bool GuardsNodes = true;
+
+  inline basic_scoped_rcu_region()
   {
-    rcu::region_begin();
+    Domain::get().region_begin();
   }
 
-  inline scoped_rcu_region(const scoped_rcu_region &that)
+  inline basic_scoped_rcu_region(const basic_scoped_rcu_region &that)
   {
-    rcu::region_begin();
+    Domain::get().region_begin();
   }
 
-  inline ~scoped_rcu_region()
+  inline ~basic_scoped_rcu_region()
   {
-    rcu::region_end();
+    Domain::get().region_end();
+  }
+
+  static inline void
+  barrier()
+  {
+    Domain::get().barrier();
   }
 
   // don't need operator=()
 
+  // the region protects everything, no need to publish individual ptrs
+  inline void protect(unsigned int, void *) const {}
+
+  template <typename D, typename P>
+  inline bool
+  load(unsigned int, D &dst, const P &src) const
+  {
+    dst = src;
+    return true;
+  }
+
   template <typename T>
   inline void
   release(T *p) const
   {
-    rcu::free_with_fn(p, rcu::deleter<T>);
+    Domain::get().free(p);
   }
 };
+
+typedef basic_scoped_rcu_region<default_rcu_domain> scoped_rcu_region;
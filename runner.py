@@ -8,7 +8,10 @@ import sys
 # config for tom
 RUNTIME=30
 THREADS = (1, 6, 12, 18, 24, 30, 36, 42, 48)
-POLICIES = ('global_lock', 'per_node_lock', 'lock_free', 'lock_free_rcu')
+POLICIES = ('global_lock', 'per_node_lock', 'lock_free', 'lock_free_split',
+            'lock_free_tagged', 'lock_free_striped', 'lock_free_biased',
+            'lock_free_deferred', 'lock_free_rcu', 'lock_free_rcu_pool',
+            'lock_free_hp', 'lock_free_ebr')
 
 GRIDS = [
   {'benchmarks' : ('readonly',),
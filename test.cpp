@@ -2,8 +2,11 @@
 #include <iostream>
 #include <initializer_list>
 #include <vector>
+#include <set>
+#include <mutex>
 #include <algorithm>
 #include <thread>
+#include <chrono>
 
 #include "policy.hpp"
 #include "asm.hpp"
@@ -23,19 +26,21 @@ public:
   }
 };
 
+template <typename LockImpl>
 static void
 atomic_ref_ptr_tests()
 {
+  typedef atomic_ref_ptr<foo, LockImpl> ptr;
   deleted = false;
   {
-    atomic_ref_ptr<foo> p(new foo);
+    ptr p(new foo);
     ASSERT(!p.get_mark());
   }
   ASSERT(deleted);
   deleted = false;
 
   {
-    atomic_ref_ptr<foo> p(new foo);
+    ptr p(new foo);
     ASSERT(!p.get_mark());
     ASSERT(p.mark());
   }
@@ -43,23 +48,556 @@ atomic_ref_ptr_tests()
   deleted = false;
 
   {
-    atomic_ref_ptr<foo> p(new foo);
-    p = atomic_ref_ptr<foo>();
+    ptr p(new foo);
+    p = ptr();
   }
   ASSERT(deleted);
   deleted = false;
 
   {
-    atomic_ref_ptr<foo> p0(new foo);
-    atomic_ref_ptr<foo> p1(new foo);
+    ptr p0(new foo);
+    ptr p1(new foo);
     p0 = p1;
     ASSERT(deleted);
     deleted = false;
   }
   ASSERT(deleted);
   deleted = false;
+
+  {
+    ptr p0(new foo);
+    ptr p1(p0);
+    ASSERT(p0.compare_exchange_strong(p1, ptr()));
+    ASSERT(!deleted);
+    ASSERT(!p0.compare_exchange_strong(p1, ptr()));
+    ASSERT(p1.mark());
+    ptr p2(p1);
+    ASSERT(!p2.get_mark());
+    ASSERT(!p1.compare_exchange_strong(p2, ptr()));
+    p2 = p0;
+    p1 = p0;
+    ASSERT(p1.get_mark());
+    ASSERT(deleted);
+    deleted = false;
+  }
+
+  {
+    // desired_value's reference goes to p0 on success, and is dropped along
+    // w/ it otherwise
+    ptr p0(new foo);
+    ASSERT(!p0.compare_exchange_strong(ptr(), ptr(new foo)));
+    ASSERT(deleted);
+    deleted = false;
+    ptr p1(p0);
+    ASSERT(p0.compare_exchange_strong(p1, ptr(new foo)));
+    ASSERT(!deleted);
+    p1 = ptr();
+    ASSERT(deleted);
+    deleted = false;
+  }
+  ASSERT(deleted);
+  deleted = false;
+
+  {
+    ptr p0(new foo);
+    ptr p1(std::move(p0));
+    ASSERT(!p0);
+    ptr p2;
+    p2 = std::move(p1);
+    ASSERT(!p1);
+    ASSERT(p2.mark());
+    // keeps the mark, and hands back the old reference
+    ptr p3 = p2.exchange(ptr());
+    ASSERT(!p2);
+    ASSERT(p2.get_mark());
+    ASSERT(p3);
+    ASSERT(!p3.get_mark());
+    ASSERT(!deleted);
+    p3 = std::move(p2);
+    ASSERT(deleted);
+    deleted = false;
+  }
+
+  {
+    // foo is 4 byte aligned, which leaves room for one tag
+    ptr p0(new foo);
+    ASSERT(!p0.template test_tag<1>());
+    ASSERT(p0.template set_tag<1>());
+    ASSERT(!p0.template set_tag<1>());
+    ASSERT(p0.template test_tag<1>());
+    ASSERT(!p0.get_mark());
+    ptr p1(p0);
+    ASSERT(p1.get() == p0.get());
+    ASSERT(!p1.template test_tag<1>());
+    p1 = ptr(new foo);
+    p0 = p1;
+    ASSERT(deleted);
+    deleted = false;
+    ASSERT(p0.template test_tag<1>());
+    ASSERT(p0.mark());
+    const typename ptr::opaque_t raw = p0.get_raw();
+    ASSERT(p0.template compare_exchange_tag<1>(raw, false));
+    ASSERT(!p0.template compare_exchange_tag<1>(raw, false));
+    ASSERT(p0.get_mark());
+    ASSERT(p0.template set_tag<1>());
+    ASSERT(p0.template clear_tag<1>());
+    ASSERT(!p0.template clear_tag<1>());
+    ASSERT(p0.get() == p1.get());
+  }
+  ASSERT(deleted);
+  deleted = false;
 }
 
+static void
+tagged_ref_ptr_tests()
+{
+  typedef atomic_ref_ptr<foo, tagged_ref_count> ptr;
+  deleted = false;
+  {
+    ptr p0(new foo);
+    ptr p1(p0);
+    const ptr::snapshot s = p0.get_snapshot();
+    ASSERT(p0.compare_exchange_strong(p1, ptr()));
+    ASSERT(p0.compare_exchange_strong(ptr(), p1));
+    // same ptr as in the snapshot, but it was swapped out in between
+    ASSERT(p0.get_raw() == s.raw);
+    ASSERT(!p0.compare_exchange_strong(s, ptr()));
+    ASSERT(p0.compare_exchange_strong(p0.get_snapshot(), ptr()));
+    ASSERT(!deleted);
+  }
+  ASSERT(deleted);
+  deleted = false;
+}
+
+static void
+guarded_ptr_tests()
+{
+  typedef atomic_ref_ptr<foo> ptr;
+  deleted = false;
+  {
+    ptr p(new foo);
+    guarded_ptr<foo> g0(p);
+    guarded_ptr<foo> g1 = g0;
+    ASSERT(g1 == g0);
+    ASSERT(g1.get() == p.get());
+    // holds no reference of its own
+    p = ptr();
+    ASSERT(deleted);
+  }
+  deleted = false;
+}
+
+static atomic<unsigned int> nbars_deleted(0);
+
+class bar : public biased_ref_counted {
+public:
+  ~bar()
+  {
+    nbars_deleted++;
+  }
+};
+
+static void
+biased_ref_counted_tests()
+{
+  typedef atomic_ref_ptr<bar> ptr;
+  nbars_deleted.store(0);
+  {
+    ptr p0(new bar);
+    ptr p1(p0);
+    p0 = ptr();
+    ASSERT(nbars_deleted.load() == 0);
+  }
+  ASSERT(nbars_deleted.load() == 1);
+
+  {
+    // drops the reference we took, so only we can tell it's gone
+    ptr p(new bar);
+    thread t([&]() { p = ptr(); });
+    t.join();
+    ASSERT(nbars_deleted.load() == 1);
+    // we merge queued objects the next time we drop a reference
+    ptr(new bar);
+    ASSERT(nbars_deleted.load() == 3);
+  }
+
+  {
+    // the owner exits before the last reference is dropped
+    ptr p;
+    thread t([&]() { p = ptr(new bar); });
+    t.join();
+    ASSERT(nbars_deleted.load() == 3);
+    p = ptr();
+    ASSERT(nbars_deleted.load() == 4);
+  }
+}
+
+static bool baz_deleted = false;
+
+class baz : public deferred_ref_counted {
+public:
+  ~baz()
+  {
+    baz_deleted = true;
+  }
+};
+
+static void
+deferred_ref_counted_tests()
+{
+  typedef atomic_ref_ptr<baz> ptr;
+  baz_deleted = false;
+  {
+    ptr p0(new baz);
+    ptr p1(p0);
+    p1 = ptr();
+    // cancels out the decrement buffered above
+    p1 = p0;
+    p0 = ptr();
+    deferred_ref_counted::flush();
+    ASSERT(!baz_deleted);
+    p1 = ptr();
+    ASSERT(!baz_deleted);
+    deferred_ref_counted::flush();
+    ASSERT(baz_deleted);
+  }
+  baz_deleted = false;
+
+  {
+    // a thread's buffered decrements are applied when it exits
+    ptr p(new baz);
+    thread t([&]() { p = ptr(); });
+    t.join();
+    ASSERT(baz_deleted);
+  }
+  baz_deleted = false;
+}
+
+static void
+rcu_reader(atomic<bool> &in_region, atomic<bool> &can_leave)
+{
+  scoped_rcu_region guard;
+  in_region.store(true);
+  while (!can_leave.load())
+    nop_pause();
+}
+
+template <typename Function>
+static void
+rcu_synchronize_waits_for_reader(Function &&sync_fn)
+{
+  atomic<bool> in_region(false);
+  atomic<bool> can_leave(false);
+  atomic<bool> synchronized(false);
+  thread reader(rcu_reader, ref(in_region), ref(can_leave));
+  while (!in_region.load())
+    nop_pause();
+  thread writer([&]() {
+    sync_fn();
+    synchronized.store(true);
+  });
+  this_thread::sleep_for(chrono::milliseconds(100));
+  ASSERT(!synchronized.load());
+  can_leave.store(true);
+  reader.join();
+  writer.join();
+  ASSERT(synchronized.load());
+}
+
+static void
+rcu_tests()
+{
+  deleted = false;
+  {
+    scoped_rcu_region guard;
+    guard.release(new foo);
+  }
+  rcu::barrier();
+  ASSERT(deleted);
+  deleted = false;
+
+  rcu_synchronize_waits_for_reader(rcu::synchronize);
+  rcu_synchronize_waits_for_reader(rcu::synchronize_expedited);
+
+  // a reader lingering in the default domain doesn't hold up other domains
+  {
+    rcu_domain d;
+    atomic<bool> in_region(false);
+    atomic<bool> can_leave(false);
+    thread reader(rcu_reader, ref(in_region), ref(can_leave));
+    while (!in_region.load())
+      nop_pause();
+    d.region_begin();
+    d.free(new foo);
+    d.region_end();
+    d.barrier();
+    ASSERT(deleted);
+    deleted = false;
+    can_leave.store(true);
+    reader.join();
+  }
+
+  // ids of destroyed domains are reused, and the state this thread kept for
+  // the old domain isn't mistaken for the new one's
+  for (unsigned int i = 0; i < 2 * rcu_domain::MaxDomains; i++) {
+    rcu_domain d(i % 2 ? rcu_domain::ReclaimInline
+                       : rcu_domain::ReclaimByGcThread);
+    d.region_begin();
+    d.free(new foo);
+    d.region_end();
+    d.barrier();
+    ASSERT(deleted);
+    deleted = false;
+  }
+
+  // w/ inline reclamation, the thread which defers deletes runs them itself
+  // as it keeps using the domain, w/o a gc thread
+  {
+    rcu_domain d(rcu_domain::ReclaimInline);
+    for (int i = 0; i < 1000 && !deleted; i++) {
+      d.region_begin();
+      d.free(new foo);
+      d.region_end();
+    }
+    ASSERT(deleted);
+    deleted = false;
+    d.region_begin();
+    d.free(new foo);
+    d.region_end();
+    d.barrier();
+    ASSERT(deleted);
+    deleted = false;
+  }
+
+  // an idle gc thread is parked, and runs the first delete deferred after
+  // that right away instead of on its epoch_us schedule
+  {
+    rcu_domain d;
+    rcu_domain::gc_policy p;
+    p.epoch_us = 60 * 1000 * 1000;
+    d.set_gc_policy(p);
+    d.region_begin();
+    d.free(new foo);
+    d.region_end();
+    for (int i = 0; i < 1000 && !deleted; i++)
+      this_thread::sleep_for(chrono::milliseconds(1));
+    ASSERT(deleted);
+    deleted = false;
+  }
+
+  // replaced objects behind an rcu_ptr outlive the readers which saw them
+  {
+    foo *f = new foo;
+    rcu_ptr<foo> p(f);
+    atomic<bool> in_region(false);
+    atomic<bool> can_leave(false);
+    thread reader([&]() {
+      scoped_rcu_region guard;
+      ASSERT(p.rcu_dereference() == f);
+      in_region.store(true);
+      while (!can_leave.load())
+        nop_pause();
+      ASSERT(!deleted);
+    });
+    while (!in_region.load())
+      nop_pause();
+    p.exchange_and_retire(new foo);
+    ASSERT(p.rcu_dereference() != f);
+    can_leave.store(true);
+    reader.join();
+    rcu::barrier();
+    ASSERT(deleted);
+    deleted = false;
+    delete p.rcu_assign(nullptr);
+    ASSERT(deleted);
+    deleted = false;
+  }
+
+  // reclaimer threads run the deletes of some of the writers. the writers
+  // never run deletes themselves, so apart from the gc thread, whoever runs
+  // one has to be a reclaimer
+  {
+    rcu_domain d;
+    rcu_domain::gc_policy p;
+    p.nreclaimers = 3;
+    d.set_gc_policy(p);
+    atomic<int> ncalls(0);
+    atomic<int> count(0);
+    mutex deleters_mutex;
+    set<thread::id> deleters;
+    atomic<bool> stop(false);
+    vector<thread> writers;
+    for (int i = 0; i < 8; i++)
+      writers.emplace_back([&]() {
+        for (int j = 0; j < 1000 || !stop.load(); j++) {
+          d.region_begin();
+          d.call([&]() {
+            count++;
+            lock_guard<mutex> l(deleters_mutex);
+            deleters.insert(this_thread::get_id());
+          });
+          d.region_end();
+          ncalls++;
+        }
+      });
+    size_t ndeleters = 0;
+    for (int i = 0; i < 10000 && ndeleters < 2; i++) {
+      this_thread::sleep_for(chrono::milliseconds(1));
+      lock_guard<mutex> l(deleters_mutex);
+      ndeleters = deleters.size();
+    }
+    stop.store(true);
+    for (auto &t : writers)
+      t.join();
+    d.barrier();
+    ASSERT(count.load() == ncalls.load());
+    ASSERT(ndeleters >= 2);
+  }
+
+  // short-lived threads leave their deletes to the domain when they exit
+  for (auto mode : {rcu_domain::ReclaimByGcThread, rcu_domain::ReclaimInline}) {
+    rcu_domain d(mode);
+    atomic<int> count(0);
+    for (int i = 0; i < 64; i++) {
+      thread t([&]() {
+        for (int j = 0; j < 10; j++) {
+          d.region_begin();
+          d.call([&count]() { count++; });
+          d.region_end();
+        }
+      });
+      t.join();
+    }
+    d.barrier();
+    ASSERT(count.load() == 64 * 10);
+  }
+
+  // a thread can exit while a grace period waits on a reader which is
+  // joining it
+  {
+    rcu_domain d;
+    rcu_domain::gc_policy p;
+    p.stall_us = 1000;
+    d.set_gc_policy(p);
+    d.region_begin();
+    thread t([&]() {
+      d.region_begin();
+      d.free(new foo);
+      d.region_end();
+      // make sure the gc thread is stuck on us
+      while (!d.get_stats().stalled_reader_us)
+        this_thread::sleep_for(chrono::milliseconds(1));
+    });
+    t.join();
+    ASSERT(!deleted);
+    d.region_end();
+    d.barrier();
+    ASSERT(deleted);
+    deleted = false;
+  }
+
+  // a reader which holds up the gc thread shows up as a stall while it lasts
+  {
+    rcu_domain d;
+    rcu_domain::gc_policy p;
+    p.stall_us = 1000;
+    d.set_gc_policy(p);
+    atomic<bool> in_region(false);
+    atomic<bool> can_leave(false);
+    thread reader([&]() {
+      d.region_begin();
+      in_region.store(true);
+      while (!can_leave.load())
+        nop_pause();
+      d.region_end();
+    });
+    while (!in_region.load())
+      nop_pause();
+    thread writer([&]() { d.synchronize(); });
+    rcu_domain::stats s;
+    for (int i = 0; i < 1000 && !(s = d.get_stats()).stalled_reader_us; i++)
+      this_thread::sleep_for(chrono::milliseconds(1));
+    ASSERT(s.stalls == 1);
+    ASSERT(s.stalled_reader_us >= p.stall_us);
+    can_leave.store(true);
+    reader.join();
+    writer.join();
+    s = d.get_stats();
+    ASSERT(!s.stalled_reader_us);
+    ASSERT(s.grace_periods > 0);
+    ASSERT(s.gp_us.count == s.grace_periods);
+    ASSERT(s.reader_wait_us.max >= p.stall_us);
+  }
+
+  // deferred calls, stored inline, on the heap, or w/ an rcu_head
+  {
+    struct big_closure {
+      int *count;
+      char pad[128];
+      void operator()() const { (*count)++; }
+    };
+    struct headed : public rcu_head {
+      int *count;
+    };
+    int count = 0;
+    foo *f = new foo;
+    headed *h = new headed;
+    h->count = &count;
+    {
+      scoped_rcu_region guard;
+      rcu::call([f, &count]() { delete f; count++; }, sizeof(foo));
+      rcu::call(big_closure{&count, {}});
+      rcu::call(h, [](rcu_head *p) {
+        headed *h = static_cast<headed *>(p);
+        (*h->count)++;
+        delete h;
+      });
+    }
+    rcu::barrier();
+    ASSERT(deleted);
+    ASSERT(count == 3);
+    deleted = false;
+  }
+
+  // a writer which keeps deferring deletes while a reader holds up the
+  // domain gets throttled, but not blocked for good
+  for (auto mode : {rcu_domain::ReclaimByGcThread, rcu_domain::ReclaimInline}) {
+    rcu_domain d(mode);
+    rcu_domain::gc_policy p;
+    p.max_deferred_objs = 256;
+    p.backpressure_us = 1000;
+    d.set_gc_policy(p);
+    atomic<bool> in_region(false);
+    atomic<bool> can_leave(false);
+    thread reader([&]() {
+      d.region_begin();
+      in_region.store(true);
+      while (!can_leave.load())
+        nop_pause();
+      d.region_end();
+    });
+    while (!in_region.load())
+      nop_pause();
+    for (int i = 0; i < 4096; i++) {
+      d.region_begin();
+      d.free(new foo);
+      d.region_end();
+    }
+    ASSERT(!deleted);
+    ASSERT(d.backpressure_count() > 0);
+    can_leave.store(true);
+    reader.join();
+    d.barrier();
+    ASSERT(deleted);
+    deleted = false;
+  }
+}
+
+struct test_rcu_tag {};
+typedef lock_free_impl<int, nop_lock, nop_ref_counted,
+                       basic_scoped_rcu_region<tagged_rcu_domain<test_rcu_tag>>>
+        lock_free_rcu_tagged;
+
 template <typename IterA, typename IterB>
 static void
 AssertEqualRanges(IterA begin_a, IterA end_a, IterB begin_b, IterB end_b)
@@ -166,11 +704,13 @@ llist_pop_front(linked_list<int, Impl> &l, atomic<bool> &f, atomic<bool> &can_st
   while (!f.load())
     nop_pause();
   for (;;) {
+    // only stop once a pop which started after the pusher was done failed
+    const bool stop = can_stop.load();
     auto ret = l.try_pop_front();
-    if (!ret.first && can_stop.load())
-      break;
     if (ret.first)
       popped.push_back(ret.second);
+    else if (stop)
+      break;
   }
 }
 
@@ -184,6 +724,17 @@ llist_remove(linked_list<int, Impl> &l, atomic<bool> &f, int range_begin, int ra
     l.remove(i);
 }
 
+// removes every nth element of [range_begin, range_end)
+template <typename Impl>
+static void
+llist_remove_every(linked_list<int, Impl> &l, atomic<bool> &f, int range_begin, int range_end, int n)
+{
+  while (!f.load())
+    nop_pause();
+  for (int i = range_begin; i < range_end; i += n)
+    l.remove(i);
+}
+
 template <typename Impl>
 static void
 llist_push_back(linked_list<int, Impl> &l, atomic<bool> &f, int range_begin, int range_end)
@@ -268,6 +819,39 @@ multi_threaded_tests()
     ASSERT(l.empty());
   }
 
+  // try concurrent removes of neighboring elements, while a reader keeps
+  // going over the list. an unlink can fail when a neighbor is unlinked at
+  // the same time, and nobody may get stuck on the node which is left behind
+  for (int iter = 0; iter < 10; iter++) {
+    llist l;
+    const int NElems = 100;
+    const int NThreads = 4;
+    for (auto e : range(0, NElems))
+      l.push_back(e);
+    vector<thread> thds;
+    atomic<bool> start_flag(false);
+    atomic<bool> done(false);
+    for (int i = 0; i < NThreads; i++) {
+      thread t(llist_remove_every<Impl>, ref(l), ref(start_flag), i, NElems, NThreads);
+      thds.push_back(move(t));
+    }
+    thread reader([&]() {
+      while (!done.load()) {
+        ASSERT(l.size() <= (size_t) NElems);
+        this_thread::yield();
+      }
+    });
+    start_flag.store(true);
+    for (auto &t : thds)
+      t.join();
+    done.store(true);
+    reader.join();
+    ASSERT(l.size() == 0);
+    l.push_back(NElems);
+    ASSERT(l.front() == NElems);
+    ASSERT(l.back() == NElems);
+  }
+
   // try non conflicting remove/push_backs, make sure we don't lose any of the
   // push_backs
   {
@@ -325,16 +909,41 @@ ExecTest(Function &&f, const string &name)
 int
 main(int argc, char **argv)
 {
-  ExecTest(atomic_ref_ptr_tests, "atomic_ref_ptr");
+  ExecTest(atomic_ref_ptr_tests<spinlock>, "atomic_ref_ptr");
+  ExecTest(atomic_ref_ptr_tests<split_ref_count>, "atomic_ref_ptr (split counts)");
+  ExecTest(atomic_ref_ptr_tests<tagged_ref_count>, "atomic_ref_ptr (tagged)");
+  ExecTest(atomic_ref_ptr_tests<striped_lock>, "atomic_ref_ptr (striped locks)");
+  ExecTest(tagged_ref_ptr_tests, "tagged atomic_ref_ptr");
+  ExecTest(guarded_ptr_tests, "guarded_ptr");
+  ExecTest(biased_ref_counted_tests, "biased_ref_counted");
+  ExecTest(deferred_ref_counted_tests, "deferred_ref_counted");
+  ExecTest(rcu_tests, "rcu");
 
   ExecTest(single_threaded_tests<typename ll_policy<int>::global_lock>, "single-threaded global_lock");
   ExecTest(single_threaded_tests<typename ll_policy<int>::per_node_lock>, "single-threaded per_node_locks");
   ExecTest(single_threaded_tests<typename ll_policy<int>::lock_free>, "single-threaded lock_free");
+  ExecTest(single_threaded_tests<typename ll_policy<int>::lock_free_split>, "single-threaded lock_free_split");
+  ExecTest(single_threaded_tests<typename ll_policy<int>::lock_free_tagged>, "single-threaded lock_free_tagged");
+  ExecTest(single_threaded_tests<typename ll_policy<int>::lock_free_striped>, "single-threaded lock_free_striped");
+  ExecTest(single_threaded_tests<typename ll_policy<int>::lock_free_biased>, "single-threaded lock_free_biased");
+  ExecTest(single_threaded_tests<typename ll_policy<int>::lock_free_deferred>, "single-threaded lock_free_deferred");
   ExecTest(single_threaded_tests<typename ll_policy<int>::lock_free_rcu>, "single-threaded lock_free_rcu");
+  ExecTest(single_threaded_tests<typename ll_policy<int>::lock_free_rcu_pool>, "single-threaded lock_free_rcu_pool");
+  ExecTest(single_threaded_tests<lock_free_rcu_tagged>, "single-threaded lock_free_rcu (tagged domain)");
+  ExecTest(single_threaded_tests<typename ll_policy<int>::lock_free_hp>, "single-threaded lock_free_hp");
+  ExecTest(single_threaded_tests<typename ll_policy<int>::lock_free_ebr>, "single-threaded lock_free_ebr");
 
   ExecTest(multi_threaded_tests<typename ll_policy<int>::global_lock>, "multi-threaded global_lock");
   ExecTest(multi_threaded_tests<typename ll_policy<int>::per_node_lock>, "multi-threaded per_node_locks");
   ExecTest(multi_threaded_tests<typename ll_policy<int>::lock_free>, "multi-threaded lock_free");
+  ExecTest(multi_threaded_tests<typename ll_policy<int>::lock_free_split>, "multi-threaded lock_free_split");
+  ExecTest(multi_threaded_tests<typename ll_policy<int>::lock_free_tagged>, "multi-threaded lock_free_tagged");
+  ExecTest(multi_threaded_tests<typename ll_policy<int>::lock_free_striped>, "multi-threaded lock_free_striped");
+  ExecTest(multi_threaded_tests<typename ll_policy<int>::lock_free_biased>, "multi-threaded lock_free_biased");
+  ExecTest(multi_threaded_tests<typename ll_policy<int>::lock_free_deferred>, "multi-threaded lock_free_deferred");
   ExecTest(multi_threaded_tests<typename ll_policy<int>::lock_free_rcu>, "multi-threaded lock_free_rcu");
+  ExecTest(multi_threaded_tests<typename ll_policy<int>::lock_free_rcu_pool>, "multi-threaded lock_free_rcu_pool");
+  ExecTest(multi_threaded_tests<typename ll_policy<int>::lock_free_hp>, "multi-threaded lock_free_hp");
+  ExecTest(multi_threaded_tests<typename ll_policy<int>::lock_free_ebr>, "multi-threaded lock_free_ebr");
   return 0;
 }
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <cstdlib>
+#include <new>
+#include <utility>
+
 #include "macros.hpp"
 
 // padded, aligned primitives
@@ -9,3 +13,23 @@ struct aligned_padded_elem {
   T elem;
   CACHE_PADOUT;
 } CACHE_ALIGNED;
+
+// operator new in C++11 does not honor CACHE_ALIGNED, so heap allocated
+// aligned objects must go through here
+template <typename T, typename... Args>
+static inline T *
+cache_aligned_new(Args &&... args)
+{
+  void *p = nullptr;
+  if (posix_memalign(&p, CACHELINE_SIZE, sizeof(T)))
+    throw std::bad_alloc();
+  return new (p) T(std::forward<Args>(args)...);
+}
+
+template <typename T>
+static inline void
+cache_aligned_delete(T *p)
+{
+  p->~T();
+  free(p);
+}